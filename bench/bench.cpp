@@ -0,0 +1,401 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "canny.hpp"
+#include "chain.hpp"
+#include "diffusion.hpp"
+#include "effects.hpp"
+#include "image.hpp"
+#include "imgutils.hpp"
+#include "pixelsort.hpp"
+#include "ppm.hpp"
+#include "resample.hpp"
+#include "rng.hpp"
+#include "terminal.hpp"
+#include "threads.hpp"
+
+#include "synth.hpp"
+
+extern char** environ;
+
+//Benchmarks for every stage of the pipeline on synthetic images, and for every mode of the glitch
+//binary end to end. One line is printed per measurement, as CSV (default) or JSON lines:
+//
+//  group, name, content, width, height, reps, median_ms, min_ms, mp_per_s, mb_per_s
+//
+//MP/s counts image pixels. MB/s counts encoded bytes for the reader and writer, and the 8 bit size
+//of the image (pixels times channels) everywhere else.
+
+//--------------------------------------------[Settings]--------------------------------------------
+
+struct size_preset{
+    const char* name;
+    int cols, rows;
+};
+
+static const size_preset presets[] = {
+    {"thumb", 160, 120},
+    {"vga", 640, 480},
+    {"hd", 1920, 1080},
+    {"4k", 3840, 2160},
+    {"24mp", 6000, 4000},
+    {"100mp", 12240, 8160},
+};
+
+static struct{
+    bool json = false;
+    double min_time = 0.25;     //seconds spent on each measurement, at least
+    int min_reps = 3;
+    int max_reps = 100;
+    std::string glitch = "./glitch";
+} opts;
+
+static std::vector<std::string> split(const std::string& list){
+    std::vector<std::string> out;
+    std::stringstream ss(list);
+    std::string item;
+    while(std::getline(ss, item, ',')) if(!item.empty()) out.push_back(item);
+    return out;
+}
+
+static bool wanted(const std::vector<std::string>& list, const std::string& name){
+    return list.empty() || std::find(list.begin(), list.end(), name) != list.end();
+}
+
+//---------------------------------------------[Timing]---------------------------------------------
+
+typedef std::chrono::steady_clock clock_type;
+
+struct sample{
+    const char* group;
+    std::string name;
+    content kind;
+    int rows, cols;
+    double pixels, bytes;       //per repetition
+};
+
+static void report(const sample& s, std::vector<double>& ms){
+    std::sort(ms.begin(), ms.end());
+    const double median = ms[ms.size() / 2];
+    const double mps = s.pixels / 1e6 / (median / 1e3);
+    const double mbs = s.bytes / 1e6 / (median / 1e3);
+    if(opts.json){
+        printf("{\"group\": \"%s\", \"name\": \"%s\", \"content\": \"%s\", \"width\": %d, \"height\": %d, "
+               "\"reps\": %zu, \"median_ms\": %.3f, \"min_ms\": %.3f, \"mp_per_s\": %.2f, \"mb_per_s\": %.2f}\n",
+               s.group, s.name.c_str(), content_name(s.kind), s.cols, s.rows, ms.size(), median, ms[0],
+               mps, mbs);
+    }
+    else{
+        printf("%s,%s,%s,%d,%d,%zu,%.3f,%.3f,%.2f,%.2f\n", s.group, s.name.c_str(), content_name(s.kind),
+               s.cols, s.rows, ms.size(), median, ms[0], mps, mbs);
+    }
+    fflush(stdout);
+}
+
+//Time <op> until both min_reps and min_time are reached. <setup> runs before every repetition,
+//outside the timed region, for stages that work in place.
+static void measure(const sample& s, const std::function<void()>& setup, const std::function<void()>& op){
+    std::vector<double> ms;
+    double total = 0;
+    while(int(ms.size()) < opts.max_reps && (int(ms.size()) < opts.min_reps || total < opts.min_time * 1e3)){
+        setup();
+        clock_type::time_point t = clock_type::now();
+        op();
+        ms.push_back(std::chrono::duration<double, std::milli>(clock_type::now() - t).count());
+        total += ms.back();
+    }
+    report(s, ms);
+}
+
+static void measure(const sample& s, const std::function<void()>& op){
+    measure(s, []{}, op);
+}
+
+//------------------------------------------[Stage Benchmarks]--------------------------------------
+
+static std::string encode(const image& img){
+    char name[] = "/tmp/glitch-bench-XXXXXX";
+    int fd = mkstemp(name);
+    writeppm(img, fd, true);
+    std::string data(lseek(fd, 0, SEEK_END), '\0');
+    pread(fd, &data[0], data.size(), 0);
+    close(fd);
+    unlink(name);
+    return data;
+}
+
+static void stages(const image& src, content kind, const std::vector<std::string>& only){
+    const int rows = src.r(), cols = src.c();
+    const double pixels = double(rows) * cols;
+    const double bytes = pixels * (src.color() ? 3 : 1);
+    auto stage = [&](const char* name, double b){
+        return sample{"stage", name, kind, rows, cols, pixels, b};
+    };
+    auto run = [&](const char* name){ return wanted(only, name); };
+
+    //shared inputs, computed once
+    const std::string encoded = encode(src);
+    image smooth = gaussian(src);
+    image mag(rows, cols);
+    plane<uint8_t> dir(rows, cols);
+    gradient(smooth.y(), mag.y(), dir);
+    double weak, strong;
+    threshold_values(mag, weak, strong);
+    image suppressed = nmsuppression(dir, mag);
+    plane<uint8_t> thresholded = threshold(suppressed, weak, strong);
+    const matrix sobel_x = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
+    const matrix sobel_y = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
+    const matrix sharpen = {{0, -1, 0}, {-1, 5, -1}, {0, -1, 0}};
+    image gx = convolution(smooth, sobel_x);
+    image gy = convolution(smooth, sobel_y);
+    const edge_mask edges = canny_edges(src);
+    int null_fd = open("/dev/null", O_WRONLY);
+    image work, out;
+    image8 edge_image;
+    plane<uint8_t> classes;
+    canny_scratch scratch;
+    edge_mask mask;
+
+    if(run("read")){
+        measure(stage("read", encoded.size()), [&]{ decodeppm(encoded.data(), encoded.size(), work); });
+    }
+    if(run("write")){
+        measure(stage("write", encoded.size()), [&]{ writeppm(src, null_fd, true); });
+    }
+    if(run("write_plain")){
+        measure(stage("write_plain", bytes), [&]{ writeppm(src, null_fd, false); });
+    }
+    if(run("write_pbm")){
+        image bits = src;
+        dither(bits);
+        measure(stage("write_pbm", bytes), [&]{ writeppm(bits, null_fd, false); });
+    }
+    if(run("gaussian")) measure(stage("gaussian", bytes), [&]{ gaussian(src, out); });
+    if(run("blur_fir")) measure(stage("blur_fir", bytes), [&]{ blur(src, out, 1.5); });
+    if(run("blur_iir")) measure(stage("blur_iir", bytes), [&]{ blur(src, out, 8); });
+    if(run("convolution")){
+        measure(stage("convolution", bytes), [&]{ out = convolution(src, sharpen); });
+    }
+    if(run("gradient")) measure(stage("gradient", bytes), [&]{ gradient(smooth.y(), mag.y(), dir); });
+    if(run("magnitude")) measure(stage("magnitude", bytes), [&]{ out = magnitude(gx, gy); });
+    if(run("angle")) measure(stage("angle", bytes), [&]{ plane<float> a = angle(gx, gy); });
+    if(run("nmsuppression")) measure(stage("nmsuppression", bytes), [&]{ nmsuppression(dir, mag, out); });
+    if(run("nms_threshold")){
+        measure(stage("nms_threshold", bytes), [&]{ nmsuppression(dir, mag, weak, strong, classes); });
+    }
+    if(run("threshold")) measure(stage("threshold", bytes), [&]{ threshold(suppressed, classes, weak, strong); });
+    if(run("hysteresis")){
+        measure(stage("hysteresis", bytes), [&]{ trace_edges(thresholded, scratch, mask); });
+    }
+    if(run("canny")) measure(stage("canny", bytes), [&]{ canny(src, edge_image, scratch, mask); });
+    if(run("dither")){
+        measure(stage("dither", bytes), [&]{ work = src; }, [&]{ diffuse(work, floyd_steinberg(), gray_palette(4)); });
+    }
+    if(run("dither_color")){
+        palette pal;
+        rgb_palette("000000,ffffff,ff0000,00ff00,0000ff,ffff00,00ffff,ff00ff", pal);
+        measure(stage("dither_color", bytes), [&]{ work = src; }, [&]{ diffuse(work, floyd_steinberg(), pal); });
+    }
+    if(run("sdither")) measure(stage("sdither", bytes), [&]{ sdither(src, edge_image); });
+    if(run("jitter")) measure(stage("jitter", bytes), [&]{ work = src; }, [&]{ jitter(work, 4); });
+    if(run("pointwise")){
+        std::vector<chain_stage> chain;
+        parse_chain("remap:0.1:0.9,clip,quantize:8", chain);
+        measure(stage("pointwise", bytes), [&]{ work = src; }, [&]{ pointwise(work, chain[0].ops); });
+    }
+    if(run("pixelsort")){
+        measure(stage("pixelsort", bytes), [&]{ work = src; }, [&]{ pixelsort(work, edges); });
+    }
+    if(run("pixelsort_angle")){
+        sort_options angled;
+        angled.angle = 30;
+        measure(stage("pixelsort_angle", bytes), [&]{ work = src; }, [&]{ pixelsort(work, edges, angled); });
+    }
+    if(run("resample")){
+        measure(stage("resample", bytes), [&]{ resample(src, out, rows / 3, cols / 3); });
+    }
+    if(run("resample_lanczos")){
+        measure(stage("resample_lanczos", bytes), [&]{ resample(src, out, rows / 3, cols / 3, LANCZOS); });
+    }
+    if(run("ascii")){
+        terminal term(null_fd, terminal::ASCII, false, false);
+        measure(stage("ascii", bytes), [&]{ term.draw(src); });
+    }
+    if(run("braille")){
+        terminal term(null_fd, terminal::BRAILLE, true, false);
+        measure(stage("braille", bytes), [&]{ term.draw(src); });
+    }
+    close(null_fd);
+}
+
+//---------------------------------------[End-to-End Benchmarks]------------------------------------
+
+//Run the glitch binary with <args>, output discarded. Returns false if it fails.
+static bool spawn(const std::vector<std::string>& args){
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(opts.glitch.c_str()));
+    for(const std::string& a : args) argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int ret = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    int status = 0;
+    if(ret || waitpid(pid, &status, 0) < 0) return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+//Frames per stream and files per batch in the multi-image modes.
+#define E2E_IMAGES 8
+
+static void modes(const image& src, content kind, const std::vector<std::string>& only){
+    const double pixels = double(src.r()) * src.c();
+    const double bytes = pixels * (src.color() ? 3 : 1);
+    char dir[] = "/tmp/glitch-bench-XXXXXX";
+    if(!mkdtemp(dir)){
+        std::cerr << "Unable to create a temporary directory.\n";
+        return;
+    }
+    const std::string base = dir;
+    const std::string file = base + "/in.ppm";
+    saveppm(src, file, true);
+    const std::string encoded = encode(src);
+    {
+        FILE* f = fopen((base + "/frames.ppm").c_str(), "wb");
+        for(int k = 0; k < E2E_IMAGES; k++) fwrite(encoded.data(), 1, encoded.size(), f);
+        fclose(f);
+    }
+    mkdir((base + "/batch").c_str(), 0755);
+    for(int k = 0; k < E2E_IMAGES; k++) saveppm(src, base + "/batch/" + std::to_string(k) + ".ppm", true);
+
+    struct mode{
+        const char* name;
+        std::vector<std::string> args;
+        int images;
+    };
+    const std::vector<mode> list = {
+        {"edges", {"-e", "-i", file, "-o", "/dev/null"}, 1},
+        {"dither", {"-d", "-i", file, "-o", "/dev/null"}, 1},
+        {"sort", {"-s", "-i", file, "-o", "/dev/null"}, 1},
+        {"jitter", {"--jitter", "4", "--seed", "1", "-i", file, "-o", "/dev/null"}, 1},
+        {"sdither", {"--sdither", "--seed", "1", "-i", file, "-o", "/dev/null"}, 1},
+        {"chain", {"--chain", "gaussian,remap:0.1:0.9,clip,quantize:8,jitter:2", "--seed", "1", "-i", file, "-o", "/dev/null"}, 1},
+        {"ascii", {"-a", "-i", file}, 1},
+        {"braille", {"-b", "-i", file}, 1},
+        {"frames", {"-f", "-e", "-i", base + "/frames.ppm", "-o", "/dev/null"}, E2E_IMAGES},
+        {"batch", {"-e", "-o", base + "/out", base + "/batch"}, E2E_IMAGES},
+    };
+    for(const mode& m : list){
+        if(!wanted(only, m.name)) continue;
+        if(!spawn(m.args)){
+            std::cerr << "Running " << opts.glitch << " for " << m.name << " failed.\n";
+            continue;
+        }
+        sample s{"e2e", m.name, kind, src.r(), src.c(), pixels * m.images, bytes * m.images};
+        measure(s, [&]{ spawn(m.args); });
+    }
+    std::string cleanup = "rm -rf '" + base + "'";
+    if(system(cleanup.c_str())) std::cerr << "Unable to remove " << base << ".\n";
+}
+
+//-----------------------------------------------[Main]---------------------------------------------
+
+static void usage(){
+    std::cout << "Usage: bench [options]\n"
+              << "\t--sizes list\tImage sizes: thumb, vga, hd, 4k, 24mp, 100mp, or WxH (default: thumb,vga,hd,4k).\n"
+              << "\t--content list\tImage content: noise, gradient, text, photo (default: photo).\n"
+              << "\t--only list\tOnly run the named stages and modes.\n"
+              << "\t--no-stages\tSkip the stage benchmarks.\n"
+              << "\t--no-e2e\tSkip the end-to-end benchmarks.\n"
+              << "\t--gray\t\tUse grayscale images.\n"
+              << "\t--json\t\tPrint JSON lines instead of CSV.\n"
+              << "\t--min-time s\tSeconds to spend on each measurement, at least (default: 0.25).\n"
+              << "\t--glitch path\tBinary for the end-to-end benchmarks (default: ./glitch).\n"
+              << "\t-j N\t\tUse N threads (default: one per CPU).\n";
+}
+
+int main(int argc, char* argv[]){
+    enum { SIZES = 256, CONTENT, ONLY, NO_STAGES, NO_E2E, GRAY, JSON, MIN_TIME, GLITCH, HELP };
+    static const struct option long_options[] = {
+        {"sizes", required_argument, nullptr, SIZES},
+        {"content", required_argument, nullptr, CONTENT},
+        {"only", required_argument, nullptr, ONLY},
+        {"no-stages", no_argument, nullptr, NO_STAGES},
+        {"no-e2e", no_argument, nullptr, NO_E2E},
+        {"gray", no_argument, nullptr, GRAY},
+        {"json", no_argument, nullptr, JSON},
+        {"min-time", required_argument, nullptr, MIN_TIME},
+        {"glitch", required_argument, nullptr, GLITCH},
+        {"help", no_argument, nullptr, HELP},
+        {nullptr, 0, nullptr, 0}
+    };
+    std::vector<std::string> sizes = {"thumb", "vga", "hd", "4k"};
+    std::vector<std::string> kinds = {"photo"};
+    std::vector<std::string> only;
+    bool run_stages = true, run_e2e = true, color = true;
+    int c;
+    while((c = getopt_long(argc, argv, "j:h", long_options, nullptr)) != -1){
+        switch(c){
+            case SIZES: sizes = split(optarg); break;
+            case CONTENT: kinds = split(optarg); break;
+            case ONLY: only = split(optarg); break;
+            case NO_STAGES: run_stages = false; break;
+            case NO_E2E: run_e2e = false; break;
+            case GRAY: color = false; break;
+            case JSON: opts.json = true; break;
+            case MIN_TIME: opts.min_time = atof(optarg); break;
+            case GLITCH: opts.glitch = optarg; break;
+            case 'j': set_threads(atoi(optarg)); break;
+            case 'h':
+            case HELP:
+                usage();
+                return 0;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if(!opts.json) printf("group,name,content,width,height,reps,median_ms,min_ms,mp_per_s,mb_per_s\n");
+    for(const std::string& size : sizes){
+        int cols = 0, rows = 0;
+        for(const size_preset& p : presets){
+            if(size == p.name){
+                cols = p.cols;
+                rows = p.rows;
+            }
+        }
+        if(!cols && sscanf(size.c_str(), "%dx%d", &cols, &rows) != 2){
+            std::cerr << "Unknown size " << size << ".\n";
+            return 1;
+        }
+        for(const std::string& name : kinds){
+            content kind;
+            if(!find_content(name, kind)){
+                std::cerr << "Unknown content " << name << ".\n";
+                return 1;
+            }
+            image src = synthesize(kind, rows, cols, color);
+            if(run_stages) stages(src, kind, only);
+            if(run_e2e) modes(src, kind, only);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include "synth.hpp"
+
+#include <vector>
+
+#include "imgutils.hpp"
+#include "resample.hpp"
+#include "rng.hpp"
+#include "threads.hpp"
+
+//-----------------------------------------[Synthetic Images]---------------------------------------
+
+static const char* names[] = {"noise", "gradient", "text", "photo"};
+
+bool find_content(const std::string& name, content& c){
+    for(int k = 0; k < 4; k++){
+        if(name == names[k]){
+            c = content(k);
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* content_name(content c){
+    return names[c];
+}
+
+//Visit every sample of every plane the image carries, row bands in parallel.
+template<typename F>
+static void fill(image& img, F fn){
+    const int planes = img.color() ? 3 : 1;
+    parallel_rows(img.r(), [&](int first, int last){
+        for(int i = first; i < last; i++){
+            for(int p = 0; p < planes; p++){
+                float* row = img.color() ? img.channel(p)[i] : img[i];
+                for(int j = 0; j < img.c(); j++) row[j] = fn(p, i, j);
+            }
+        }
+    });
+}
+
+static inline float unit(uint64_t r){
+    return (r >> 40) * (1.0f / (1 << 24));
+}
+
+//Lines of 5x7 glyphs in 8x12 cells, dark on light, with the odd short line and paragraph gap.
+static float text_sample(uint64_t seed, int i, int j){
+    const int line = i / 12, y = i % 12 - 2;
+    const int cell = j / 8, x = j % 8 - 1;
+    if(y < 0 || y >= 7 || x < 0 || x >= 5) return 0.95f;
+    uint64_t layout = random_at(seed, 1, line);
+    if(layout % 7 == 0) return 0.95f;                           //blank line
+    if(cell > int(40 + (layout >> 8) % 200)) return 0.95f;      //ragged right margin
+    uint64_t glyph = random_at(seed, 2, uint64_t(line) << 32 | cell);
+    if(glyph % 6 == 0) return 0.95f;                            //space
+    return (glyph >> (8 + y * 5 + x)) & 1 ? 0.1f : 0.95f;
+}
+
+image synthesize(content kind, int rows, int cols, bool color, uint64_t seed){
+    image img(rows, cols, color);
+    switch(kind){
+        case NOISE:
+            fill(img, [&](int p, int i, int j){
+                return unit(random_at(seed, p, uint64_t(i) * cols + j));
+            });
+            break;
+        case GRADIENT:
+            fill(img, [&](int p, int i, int j){
+                float u = float(j) / cols, v = float(i) / rows;
+                return p == 0 ? u : (p == 1 ? v : 0.5f * (u + v));
+            });
+            break;
+        case TEXT:
+            fill(img, [&](int, int i, int j){
+                return text_sample(seed, i, j);
+            });
+            break;
+        case PHOTO:{
+            //a coarse random field blown up to full size, a few hard-edged boxes, and grain
+            image coarse = synthesize(NOISE, 12, 16, color, seed + 1);
+            image smooth = resample(coarse, rows, cols, BILINEAR);
+            const int boxes = 24;
+            std::vector<int> box(boxes * 4);
+            std::vector<float> shade(boxes * 3);
+            for(int b = 0; b < boxes; b++){
+                uint64_t r = random_at(seed, 3, b);
+                box[4*b] = r % rows;
+                box[4*b + 1] = (r >> 16) % cols;
+                box[4*b + 2] = rows / 16 + (r >> 32) % (rows / 4 + 1);
+                box[4*b + 3] = cols / 16 + (r >> 48) % (cols / 4 + 1);
+                for(int p = 0; p < 3; p++) shade[3*b + p] = unit(random_at(seed, 4, 3*b + p));
+            }
+            fill(img, [&](int p, int i, int j){
+                float v = color ? smooth.channel(p)[i][j] : smooth[i][j];
+                for(int b = 0; b < boxes; b++){
+                    if(i >= box[4*b] && i < box[4*b] + box[4*b + 2] && j >= box[4*b + 1] && j < box[4*b + 1] + box[4*b + 3]){
+                        v = shade[3*b + p];
+                    }
+                }
+                v += 0.04f * (unit(random_at(seed, 5 + p, uint64_t(i) * cols + j)) - 0.5f);
+                return MIN(MAX(v, 0.0f), 1.0f);
+            });
+            break;
+        }
+    }
+    if(color) img.update_luma();
+    img.set_format(color ? "P6" : "P5");
+    return img;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+#include "image.hpp"
+
+//-----------------------------------------[Synthetic Images]---------------------------------------
+
+//Content types, chosen to stress different paths: noise defeats every early-out and makes canny
+//find edges everywhere, gradients are smooth, text is mostly flat with dense hard edges, and the
+//photo-like content mixes smooth regions, hard shapes and grain.
+enum content { NOISE, GRADIENT, TEXT, PHOTO };
+
+bool find_content(const std::string&, content&);
+const char* content_name(content);
+image synthesize(content, int rows, int cols, bool color, uint64_t seed = 1);
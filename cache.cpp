@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.hpp"
+#include "canny.hpp"
+#include "image.hpp"
+#include "imgutils.hpp"
+#include "rng.hpp"
+#include "threads.hpp"
+#include "trace.hpp"
+
+namespace fs = std::filesystem;
+
+static std::string cache_dir;
+static size_t cache_limit = 0;
+static bool report_stats = false;
+static std::atomic<int64_t> hits(0), misses(0), stores(0), stored_bytes(0), evictions(0);
+static std::atomic<int> next_temp(0);
+static std::mutex size_lock;
+static uintmax_t cache_bytes = 0;       //size of the entries when last scanned, plus what was stored since
+
+struct cache_file;
+static uintmax_t scan(std::vector<cache_file>* files = nullptr);
+
+static void print_report(){
+    fprintf(stderr, "cache: %lld hits, %lld misses, %lld stored (%.2f MB), %lld evicted\n",
+            (long long)hits.load(), (long long)misses.load(), (long long)stores.load(),
+            stored_bytes.load() / 1048576.0, (long long)evictions.load());
+}
+
+//Keep entries in <dir>, at most <limit> bytes of them. With <report> set, the hits and misses are
+//printed to stderr when the program exits.
+void open_cache(const std::string& dir, size_t limit, bool report){
+    std::error_code err;
+    fs::create_directories(dir, err);
+    if(!fs::is_directory(dir, err)){
+        std::cerr << "Unable to create cache directory.\n";
+        exit(1);
+    }
+    cache_dir = dir;
+    cache_limit = limit;
+    report_stats = report;
+    cache_bytes = scan();
+    if(report) atexit(print_report);
+}
+
+bool cache_enabled(){
+    return !cache_dir.empty();
+}
+
+//---------------------------------------------[Keys]-----------------------------------------------
+
+static inline uint64_t rotl(uint64_t x, int k){
+    return (x << k) | (x >> (64 - k));
+}
+
+//Two multiply-rotate lanes over 16 bytes at a time, finished by the mix of the counter-based
+//generator. Fast enough that hashing an image costs a small fraction of detecting its edges.
+static uint64_t hash_bytes(const void* data, size_t n, uint64_t seed){
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t a = seed ^ 0x9e3779b97f4a7c15ull, b = n;
+    for(; n >= 16; n -= 16, p += 16){
+        uint64_t x, y;
+        memcpy(&x, p, 8);
+        memcpy(&y, p + 8, 8);
+        a = rotl(a ^ (x * 0x87c37b91114253d5ull), 31) * 0x4cf5ad432745937full;
+        b = rotl(b ^ (y * 0x4cf5ad432745937full), 33) * 0x87c37b91114253d5ull;
+    }
+    uint64_t tail[2] = {0, 0};
+    memcpy(tail, p, n);
+    a ^= tail[0];
+    b ^= tail[1];
+    return random_at(a, b, seed);
+}
+
+//Hash of the samples of <p>, leaving out row padding. Rows are hashed in parallel and combined in
+//order, so the hash does not depend on the number of threads.
+static uint64_t hash_plane(const plane<float>& p, uint64_t h){
+    std::vector<uint64_t> rows(p.r());
+    uint64_t* out = rows.data();
+    parallel_rows(p.r(), [&](int first, int last){
+        for(int i = first; i < last; i++) out[i] = hash_bytes(p[i], p.c() * sizeof(float), i);
+    });
+    for(int i = 0; i < p.r(); i++) h = random_at(h, out[i], i);
+    return h;
+}
+
+//Hash of the decoded samples of <img>: luma alone, or every plane if <color> is set.
+uint64_t hash_image(const image& img, bool color){
+    TRACE("hash_image");
+    uint64_t h = random_at(img.r(), img.c(), color && img.color());
+    h = hash_plane(img.y(), h);
+    for(int k = 0; k < 3 && color && img.color(); k++) h = hash_plane(img.channel(k), h);
+    return h;
+}
+
+//The key of what <stage> makes from an image with the given pixel hash. <stage> names the stage and
+//every parameter that changes its result, and should change whenever the stage does.
+uint64_t cache_key(uint64_t pixels, const std::string& stage){
+    return random_at(pixels, hash_bytes(stage.data(), stage.size(), 0), 0);
+}
+
+//--------------------------------------------[Entries]---------------------------------------------
+
+enum { ENTRY_EDGES = 1, ENTRY_IMAGE };
+
+struct entry_header{
+    char magic[4];                  //"GLC1"
+    uint32_t kind;
+    uint64_t key;
+    int32_t rows, cols;
+    int32_t count;                  //runs of an edge mask, or planes of an image
+    int32_t maxval;
+    char format[4];
+};
+
+static std::string entry_path(uint64_t key, int kind){
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.%s", (unsigned long long)key, kind == ENTRY_EDGES ? "edges" : "image");
+    return (fs::path(cache_dir) / name).string();
+}
+
+//A cache file mapped into memory. Mapping it marks it as used just now, which is what eviction goes by.
+class mapped_entry{
+    private:
+        void* map;
+        size_t len;
+    public:
+        mapped_entry(const std::string& path): map(MAP_FAILED), len(0) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if(fd < 0) return;
+            struct stat st;
+            if(fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(entry_header)){
+                len = st.st_size;
+                map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+                futimens(fd, nullptr);
+            }
+            close(fd);
+        }
+        ~mapped_entry(){ if(map != MAP_FAILED) munmap(map, len); }
+        mapped_entry(const mapped_entry&) = delete;
+        mapped_entry& operator=(const mapped_entry&) = delete;
+
+        //The header, if the entry exists and is one of <kind> for <key>.
+        const entry_header* header(uint64_t key, int kind) const {
+            if(map == MAP_FAILED) return nullptr;
+            const entry_header* h = static_cast<const entry_header*>(map);
+            if(memcmp(h->magic, "GLC1", 4) || h->kind != uint32_t(kind) || h->key != key) return nullptr;
+            if(h->rows < 0 || h->cols < 0 || h->count < 0) return nullptr;
+            return h;
+        }
+        const char* data() const { return static_cast<const char*>(map) + sizeof(entry_header); }
+        size_t size() const { return len - sizeof(entry_header); }
+};
+
+struct cache_file{
+    fs::path path;
+    uintmax_t size;
+    fs::file_time_type used;
+};
+
+//The entries in the directory and their total size.
+static uintmax_t scan(std::vector<cache_file>* files){
+    std::error_code err;
+    uintmax_t total = 0;
+    for(const fs::directory_entry& e : fs::directory_iterator(cache_dir, err)){
+        const std::string ext = e.path().extension().string();
+        if(!e.is_regular_file(err) || (ext != ".edges" && ext != ".image")) continue;
+        cache_file f = {e.path(), e.file_size(err), e.last_write_time(err)};
+        if(err) continue;
+        if(files) files->push_back(f);
+        total += f.size;
+    }
+    return total;
+}
+
+//Delete the least recently used entries until the directory is within its limit. The directory is
+//only walked once the running total says it has grown past the limit; the walk also picks up what
+//other processes sharing the directory have stored. Called with size_lock held.
+static void evict(){
+    if(cache_bytes <= cache_limit) return;
+    std::error_code err;
+    std::vector<cache_file> files;
+    cache_bytes = scan(&files);
+    std::sort(files.begin(), files.end(), [](const cache_file& a, const cache_file& b){ return a.used < b.used; });
+    for(const cache_file& f : files){
+        if(cache_bytes <= cache_limit) break;
+        if(fs::remove(f.path, err)){
+            evictions++;
+            cache_bytes -= f.size;
+        }
+    }
+}
+
+//Delete an entry that failed to load.
+static void discard(const std::string& path){
+    std::lock_guard<std::mutex> lock(size_lock);
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0 && unlink(path.c_str()) == 0){
+        cache_bytes -= MIN(cache_bytes, uintmax_t(st.st_size));
+    }
+}
+
+//Write the entry to a temporary file and rename it into place, so that readers, in this process or
+//another, never see half an entry.
+static void store(uint64_t key, int kind, entry_header h, const std::vector<char>& payload){
+    TRACE("cache_store");
+    memcpy(h.magic, "GLC1", 4);
+    h.kind = kind;
+    h.key = key;
+    const std::string path = entry_path(key, kind);
+    const std::string temp = (fs::path(cache_dir) / ("." + std::to_string(getpid()) + "." +
+                              std::to_string(next_temp++) + ".tmp")).string();
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return;
+    bool ok = true;
+    const char* parts[2] = {reinterpret_cast<const char*>(&h), payload.data()};
+    size_t sizes[2] = {sizeof(h), payload.size()};
+    for(int k = 0; k < 2 && ok; k++){
+        const char* p = parts[k];
+        size_t n = sizes[k];
+        while(n && ok){
+            ssize_t w = write(fd, p, n);
+            if(w < 0 && errno == EINTR) continue;
+            ok = w > 0;
+            if(ok){
+                p += w;
+                n -= w;
+            }
+        }
+    }
+    if(close(fd) != 0) ok = false;
+    const uintmax_t size = sizeof(h) + payload.size();
+    std::lock_guard<std::mutex> lock(size_lock);
+    struct stat st;
+    const uintmax_t replaced = stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+    if(!ok || rename(temp.c_str(), path.c_str()) != 0){
+        unlink(temp.c_str());
+        return;
+    }
+    stores++;
+    stored_bytes += size;
+    cache_bytes += size;
+    cache_bytes -= MIN(replaced, cache_bytes);
+    evict();
+}
+
+//------------------------------------------[Edge Masks]--------------------------------------------
+
+//An edge mask is stored as its row starts followed by its runs, as 32-bit integers.
+
+//Whether the payload is a mask the effects can index with: row starts that never decrease, from 0
+//to the number of runs, and in every row runs that are not empty, lie within the columns of the
+//image, and come in order with a gap between each and the next.
+static bool valid_runs(const entry_header& h, const int32_t* begin){
+    if(begin[0] != 0 || begin[h.rows] != h.count) return false;
+    for(int i = 0; i < h.rows; i++){
+        if(begin[i + 1] < begin[i]) return false;
+    }
+    const int32_t* runs = begin + h.rows + 1;
+    for(int i = 0; i < h.rows; i++){
+        int32_t after = -1;         //end of the previous run in the row
+        for(int k = begin[i]; k < begin[i + 1]; k++){
+            const int32_t start = runs[2 * k], end = runs[2 * k + 1];
+            if(start <= after || start >= end || end > h.cols) return false;
+            after = end;
+        }
+    }
+    return true;
+}
+
+//The mask stored under <key>, if there is one for an image of <rows> by <cols>. A mask of another
+//size under the same key is a hash collision and counts as a miss; storing replaces it.
+bool load_edges(uint64_t key, int rows, int cols, edge_mask& mask){
+    TRACE("cache_load");
+    const std::string path = entry_path(key, ENTRY_EDGES);
+    mapped_entry e(path);
+    const entry_header* h = e.header(key, ENTRY_EDGES);
+    if(!h || e.size() != (size_t(h->rows) + 1) * sizeof(int32_t) + size_t(h->count) * 2 * sizeof(int32_t) ||
+       !valid_runs(*h, reinterpret_cast<const int32_t*>(e.data()))){
+        if(h) discard(path);
+        misses++;
+        return false;
+    }
+    if(h->rows != rows || h->cols != cols){
+        misses++;
+        return false;
+    }
+    const int32_t* begin = reinterpret_cast<const int32_t*>(e.data());
+    const int32_t* runs = begin + h->rows + 1;
+    mask.rows = h->rows;
+    mask.cols = h->cols;
+    mask.begin.assign(begin, begin + h->rows + 1);
+    mask.runs.resize(h->count);
+    for(int k = 0; k < h->count; k++) mask.runs[k] = edge_run{runs[2 * k], runs[2 * k + 1]};
+    hits++;
+    return true;
+}
+
+void store_edges(uint64_t key, const edge_mask& mask){
+    std::vector<char> payload((mask.begin.size() + 2 * mask.runs.size()) * sizeof(int32_t));
+    int32_t* out = reinterpret_cast<int32_t*>(payload.data());
+    for(int b : mask.begin) *out++ = b;
+    for(const edge_run& r : mask.runs){
+        *out++ = r.start;
+        *out++ = r.end;
+    }
+    entry_header h = {};
+    h.rows = mask.rows;
+    h.cols = mask.cols;
+    h.count = mask.runs.size();
+    store(key, ENTRY_EDGES, h, payload);
+}
+
+//--------------------------------------------[Images]----------------------------------------------
+
+//Images are stored as float samples, plane after plane (luma, then red, green and blue), without
+//row padding. They are meant for small derived images such as terminal previews.
+bool load_image(uint64_t key, image& img){
+    TRACE("cache_load");
+    const std::string path = entry_path(key, ENTRY_IMAGE);
+    mapped_entry e(path);
+    const entry_header* h = e.header(key, ENTRY_IMAGE);
+    const size_t row = size_t(h ? h->cols : 0) * sizeof(float);
+    if(!h || (h->count != 1 && h->count != 4) || e.size() != row * h->rows * h->count){
+        if(h) discard(path);
+        misses++;
+        return false;
+    }
+    img.reshape(h->rows, h->cols, h->count == 4);
+    img.set_format(std::string(h->format, strnlen(h->format, 4)));
+    img.set_maxval(h->maxval);
+    const char* src = e.data();
+    for(int p = 0; p < h->count; p++){
+        plane<float>& dst = p ? img.channel(p - 1) : img.y();
+        for(int i = 0; i < h->rows; i++, src += row) memcpy(dst[i], src, row);
+    }
+    hits++;
+    return true;
+}
+
+void store_image(uint64_t key, const image& img){
+    const int planes = img.color() ? 4 : 1;
+    const size_t row = size_t(img.c()) * sizeof(float);
+    std::vector<char> payload(row * img.r() * planes);
+    char* out = payload.data();
+    for(int p = 0; p < planes; p++){
+        const plane<float>& src = p ? img.channel(p - 1) : img.y();
+        for(int i = 0; i < img.r(); i++, out += row) memcpy(out, src[i], row);
+    }
+    entry_header h = {};
+    h.rows = img.r();
+    h.cols = img.c();
+    h.count = planes;
+    h.maxval = img.get_maxval();
+    const std::string& format = img.get_format();
+    memcpy(h.format, format.data(), MIN(format.size(), sizeof(h.format)));
+    store(key, ENTRY_IMAGE, h, payload);
+}
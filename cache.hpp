@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+template<typename T> class basic_image;
+typedef basic_image<float> image;
+struct edge_mask;
+
+//---------------------------------------------[Cache]----------------------------------------------
+
+//Optional on-disk cache for results that depend only on the pixels of an image, such as its edges.
+//Entries are files in one directory, named by a hash of the decoded samples and of the parameters of
+//the stage that made them, and are read back with a memory-mapped load. When the directory grows past
+//its size limit, the entries used least recently are deleted.
+
+void open_cache(const std::string& dir, size_t limit, bool report);
+bool cache_enabled();
+
+uint64_t hash_image(const image&, bool color);
+uint64_t cache_key(uint64_t pixels, const std::string& stage);
+
+bool load_edges(uint64_t key, int rows, int cols, edge_mask&);
+void store_edges(uint64_t key, const edge_mask&);
+bool load_image(uint64_t key, image&);
+void store_image(uint64_t key, const image&);
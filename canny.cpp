@@ -1,82 +1,204 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+
 #include "image.hpp"
 #include "canny.hpp"
+#include "threads.hpp"
+#include "trace.hpp"
 
-//Canny Edge Detector
-image canny(const image& img){
-    matrix x = {{-1.0, 0.0, 1.0},
-                {-2.0, 0.0, 2.0},
-                {-1.0, 0.0, 1.0}};
-    matrix y = {{-1,-2,-1},
-                {0, 0, 0},
-                {1, 2, 1}};
-    image smooth = gaussian(img);
-    image xedge = convolution(smooth, x);
-    image yedge = convolution(smooth, y); //range: [-4, 4]
-    image mag = magnitude(xedge, yedge);  //range: [0, sqrt(32)]
-    remap(mag, 0, sqrt(32));
-    matrix ang = angle(xedge, yedge);
+//Canny Edge Detector. The edges come out as runs per row, for callers that only need to know where
+//they are; canny() draws them into an image. Non-maximum suppression and the double threshold run as
+//one pass that writes a byte per pixel, which hysteresis then packs to bits.
+void canny_edges(const image& img, canny_scratch& s, edge_mask& mask){
+    TRACE("canny_edges");
+    gaussian(img, s.smooth);
+    s.mag.reshape(img.r(), img.c(), false);
+    s.dir.reshape(img.r(), img.c());
+    gradient(s.smooth.y(), s.mag.y(), s.dir);
     double weak, strong;
-    std::vector<coord> stronglist;
-    threshold_values(mag, weak, strong);
-    image suppressed = nmsuppression(ang, mag);
-    image out = threshold(suppressed, weak, strong, stronglist);
-    hysteresis(out, stronglist);
+    threshold_values(s.mag, weak, strong);
+    nmsuppression(s.dir, s.mag, weak, strong, s.classes);
+    trace_edges(s.classes, s, mask);
+}
+
+edge_mask canny_edges(const image& img){
+    canny_scratch s;
+    edge_mask mask;
+    canny_edges(img, s, mask);
+    return mask;
+}
+
+//Edges come out as 8-bit samples, 0 or 255.
+void canny(const image& img, image8& out, canny_scratch& s, edge_mask& mask){
+    TRACE("canny");
+    canny_edges(img, s, mask);
+    edge_image(mask, out);
+}
+
+//Draw <mask> the way canny() does, for edges that were found earlier.
+void edge_image(const edge_mask& mask, image8& out){
+    out.reshape(mask.rows, mask.cols, false);
+    out.set_maxval(255);
+    draw_edges(mask, out);
     out.set_format("P2");
+}
+
+image8 canny(const image& img){
+    canny_scratch s;
+    edge_mask mask;
+    image8 out;
+    canny(img, out, s, mask);
     return out;
 }
 
-//--------------------------------------[Threshold Functions]---------------------------------------
+//-------------------------------------------[Gradient]---------------------------------------------
+
+//Quantize a gradient to one of the four directions with slope comparisons instead of atan2. The
+//buckets are those of roundangle() applied to the truncated angle in degrees: [0, 23) -> 0,
+//[23, 68) -> 45, [68, 113) -> 90, [113, 156) -> 135 and everything else, including all negative
+//angles, -> 0.
+static inline uint8_t direction(float gx, float gy){
+    const float tan23 = 0.42447481f;   //tan(23 deg); cot(113 deg) == -tan(23 deg)
+    const float tan68 = 2.47508685f;
+    const float cot24 = 2.24603677f;   //cot(156 deg) == -cot(24 deg)
+    uint8_t d = gy < tan23 * gx ? DIR_0
+              : gy < tan68 * gx ? DIR_45
+              : gx > -tan23 * gy ? DIR_90
+              : gx > -cot24 * gy ? DIR_135
+              : DIR_0;
+    return gy > 0 ? d : uint8_t(DIR_0);
+}
 
-//double threshold
-image threshold(const image& img, double weak, double strong, std::vector<coord>& stronglist){
-    image out(img.r(), img.c());
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            //Strong pixels have a value of 1,
-            //candidates are 1/2, and weak pixels are 0.
-            if(img[i][j].y >= strong){
-                out[i][j] = pixel(1.0);
-                stronglist.push_back(coord(i, j));
+//Sobel gradient, magnitude and direction in a single sweep over the smoothed image. Magnitude is
+//scaled from [0, sqrt(32)] to [0, 1]; direction is one of the DIR_* codes.
+void gradient(const plane<float>& smooth, plane<float>& mag, plane<uint8_t>& dir){
+    TRACE("gradient");
+    const int h = smooth.r();
+    const int w = smooth.c();
+    const float scale = 1.0f / sqrtf(32.0f);
+    parallel_rows(h, [&](int first, int last){
+        for(int i = first; i < last; i++){
+            const float* up = smooth[i > 0 ? i - 1 : 0];
+            const float* mid = smooth[i];
+            const float* dn = smooth[i < h - 1 ? i + 1 : h - 1];
+            float* m = mag[i];
+            uint8_t* d = dir[i];
+            for(int j = 0; j < w; j++){
+                //extend the edge pixels to infinity
+                int l = j > 0 ? j - 1 : 0;
+                int r = j < w - 1 ? j + 1 : w - 1;
+                float gx = (up[r] - up[l]) + 2 * (mid[r] - mid[l]) + (dn[r] - dn[l]);
+                float gy = (dn[l] + 2 * dn[j] + dn[r]) - (up[l] + 2 * up[j] + up[r]);
+                m[j] = sqrtf(gx * gx + gy * gy) * scale;
+                d[j] = direction(gx, gy);
             }
-            else if(img[i][j].y >= weak) out[i][j] = pixel(0.5);
-            else out[i][j] = pixel(0);
         }
-    }
+    });
+}
+
+//--------------------------------------[Threshold Functions]---------------------------------------
+
+static inline uint8_t classify(float v, double weak, double strong){
+    return v >= strong ? EDGE_STRONG : (v >= weak ? EDGE_CANDIDATE : EDGE_WEAK);
+}
+
+//double threshold, to one EDGE_* class per pixel
+void threshold(const image& img, plane<uint8_t>& out, double weak, double strong){
+    TRACE("threshold");
+    out.reshape(img.r(), img.c());
+    parallel_rows(img.r(), [&](int first, int last){
+        for(int i = first; i < last; i++){
+            const float* src = img[i];
+            uint8_t* dst = out[i];
+            for(int j = 0; j < img.c(); j++) dst[j] = classify(src[j], weak, strong);
+        }
+    });
+}
+
+plane<uint8_t> threshold(const image& img, double weak, double strong){
+    plane<uint8_t> out;
+    threshold(img, out, weak, strong);
     return out;
 }
 
 
+//Magnitudes this dark are left out of the threshold statistics altogether.
+#define THRESHOLD_IGNORE (0.5 / 255.0)
+
+//Sum and count of the magnitudes in a row that are not ignored.
+void magnitude_sums(const float* row, int w, double& sum, int& num){
+    sum = 0;
+    num = 0;
+    for(int j = 0; j < w; j++){
+        if(row[j] > THRESHOLD_IGNORE){
+            sum += row[j];
+            num++;
+        }
+    }
+}
+
+//The same split at <average>: weak sums the magnitudes below it, strong the rest.
+void magnitude_sums(const float* row, int w, double average, double& wsum, int& wnum, double& ssum, int& snum){
+    wsum = ssum = 0;
+    wnum = snum = 0;
+    for(int j = 0; j < w; j++){
+        if(row[j] > THRESHOLD_IGNORE){
+            if(row[j] < average){
+                wsum += row[j];
+                wnum++;
+            }
+            else{
+                ssum += row[j];
+                snum++;
+            }
+        }
+    }
+}
+
 //calculate some usable values for the double threashold pass
+//Sums are taken per row in parallel and then added up in row order, so the result does not depend
+//on the number of threads. The per-row sums are kept between calls.
 void threshold_values(const image& img, double& weak, double& strong){
+    TRACE("threshold_values");
+    static thread_local std::vector<double> sums;
+    static thread_local std::vector<int> counts;
+    const int h = img.r();
+    sums.resize(3 * h);
+    counts.resize(3 * h);
+    //the bands run on other threads, which must see this thread's buffers
+    double* sum = sums.data();
+    double* wsum = sum + h;
+    double* ssum = wsum + h;
+    int* num = counts.data();
+    int* wnum = num + h;
+    int* snum = wnum + h;
     double average = 0;
-    double ignore = 0.5 / 255.0;   //totally ignore these dark values.
-    int count = 0;
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            if(img[i][j].y > ignore){
-                average += img[i][j].y;
-                count++;
-            }
-        }
+    int64_t count = 0;
+    parallel_rows(h, [&](int first, int last){
+        for(int i = first; i < last; i++) magnitude_sums(img[i], img.c(), sum[i], num[i]);
+    });
+    for(int i = 0; i < h; i++){
+        average += sum[i];
+        count += num[i];
     }
     average /= count;
     double weak_avg = 0;
-    int weak_count = 0;
+    int64_t weak_count = 0;
     double strong_avg = 0;
-    int strong_count = 0;
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            if(img[i][j].y > ignore){
-                if(img[i][j].y < average){
-                    weak_avg += img[i][j].y;
-                    weak_count++;
-                }
-                else{
-                    strong_avg += img[i][j].y;
-                    strong_count++;
-                }
-            }
+    int64_t strong_count = 0;
+    parallel_rows(h, [&](int first, int last){
+        for(int i = first; i < last; i++){
+            magnitude_sums(img[i], img.c(), average, wsum[i], wnum[i], ssum[i], snum[i]);
         }
+    });
+    for(int i = 0; i < h; i++){
+        weak_avg += wsum[i];
+        weak_count += wnum[i];
+        strong_avg += ssum[i];
+        strong_count += snum[i];
     }
     weak = weak_avg/weak_count;
     strong = strong_avg/strong_count;
@@ -85,75 +207,263 @@ void threshold_values(const image& img, double& weak, double& strong){
 
 //-----------------------------------------[Edge Thinning]------------------------------------------
 
-//Non-maximum suppression
-image nmsuppression(const matrix& ang, const image& mag){
-    image out(mag.r(), mag.c());
-    double testa, testb;
-    for(int i = 0; i < mag.r(); i++){
-        for(int j = 0; j < mag.c(); j++){
-            //East/West edge
-            if(ang[i][j] == 0){
-                testa = i > 0 ? mag[i-1][j].y : 0;
-                testb = i < mag.r() - 1 ? mag[i+1][j].y : 0;
-            }
-            //NE/SW edge
-            else if(ang[i][j] == 45){
-                testa = i > 0 && j < mag.c() - 1 ? mag[i-1][j+1].y : 0;
-                testb = i < mag.r() - 1 && j > 0 ? mag[i+1][j-1].y : 0;
-            }
-            //North/South edge
-            else if(ang[i][j] == 90){
-                testa = j > 0 ? mag[i][j - 1].y : 0;
-                testb = j < mag.c() - 1 ? mag[i][j + 1].y : 0;
-            }
-            //NW/SE edge
-            else if(ang[i][j] == 135){
-                testa = i > 0 && j > 0 ? mag[i-1][j-1].y : 0;
-                testb = i < mag.r() - 1 && j < mag.c() - 1 ? mag[i+1][j+1].y : 0;
+//Non-maximum suppression. Neighbours outside the image count as 0. Every output sample is <keep>
+//applied to the suppressed magnitude.
+template<typename T, typename K>
+static void suppress(const plane<uint8_t>& dir, const image& mag, plane<T>& out, K keep){
+    out.reshape(mag.r(), mag.c());
+    const int h = mag.r();
+    const int w = mag.c();
+    parallel_rows(h, [&](int first, int last){
+        for(int i = first; i < last; i++){
+            const float* up = i > 0 ? mag[i - 1] : nullptr;
+            const float* mid = mag[i];
+            const float* dn = i < h - 1 ? mag[i + 1] : nullptr;
+            const uint8_t* d = dir[i];
+            T* dst = out[i];
+            float testa, testb;
+            for(int j = 0; j < w; j++){
+                switch(d[j]){
+                    //East/West edge
+                    case DIR_0:
+                        testa = up ? up[j] : 0;
+                        testb = dn ? dn[j] : 0;
+                        break;
+                    //NE/SW edge
+                    case DIR_45:
+                        testa = up && j < w - 1 ? up[j+1] : 0;
+                        testb = dn && j > 0 ? dn[j-1] : 0;
+                        break;
+                    //North/South edge
+                    case DIR_90:
+                        testa = j > 0 ? mid[j-1] : 0;
+                        testb = j < w - 1 ? mid[j+1] : 0;
+                        break;
+                    //NW/SE edge
+                    default:
+                        testa = up && j > 0 ? up[j-1] : 0;
+                        testb = dn && j < w - 1 ? dn[j+1] : 0;
+                        break;
+                }
+                dst[j] = keep(mid[j] > testa && mid[j] > testb ? mid[j] : 0);
             }
-
-            if(mag[i][j].y > testa && mag[i][j].y > testb) out[i][j] = mag[i][j];
-            else out[i][j] = pixel(0);
         }
-    }
+    });
+}
+
+void nmsuppression(const plane<uint8_t>& dir, const image& mag, image& out){
+    TRACE("nmsuppression");
+    out.reshape(mag.r(), mag.c(), false);
+    suppress(dir, mag, out.y(), [](float v){ return v; });
+}
+
+image nmsuppression(const plane<uint8_t>& dir, const image& mag){
+    image out;
+    nmsuppression(dir, mag, out);
     return out;
 }
 
+//Non-maximum suppression and the double threshold in one pass.
+void nmsuppression(const plane<uint8_t>& dir, const image& mag, double weak, double strong,
+                   plane<uint8_t>& out){
+    TRACE("nmsuppression");
+    suppress(dir, mag, out, [&](float v){ return classify(v, weak, strong); });
+}
+
 //-------------------------------------------[Hysteresis]-------------------------------------------
 
-void chain(image& img, int r, int c, bool** visited){
-    if(visited[r][c]) return; //already been here, don't bother
-    visited[r][c] = true;
-    img[r][c] = pixel(1.0); //we can only get here from a strong pixel, so we can make this one strong.
-    //look at the 3x3 grid around [r][c]
-    for(int i = r - 1; i <= r + 1; i++){
-        for(int j = c - 1; j <=c + 1; j++){
-            //if the pixel is out of bounds, ignore it.
-            if(i < 0 || j < 0 || i >= img.r() || j >= img.c()) continue;
-            //if the next pixel is strong, or is a candidate, add it to the chain.
-            if(!visited[i][j] && img[i][j].y >= 0.5) chain(img, i, j, visited);
-        }
+//A pixel survives hysteresis iff it is 8-connected, through candidate or strong pixels, to a strong
+//pixel. Rather than following chains pixel by pixel, the candidate mask is bit-packed, cut into
+//horizontal runs, and the runs are joined with union-find: first inside tiles of rows in parallel,
+//then across tile seams. A component is kept if any of its runs contains a strong pixel.
+
+#define HYSTERESIS_TILE 64
+
+typedef candidate_run run;
+
+static int find_root(std::vector<int>& parent, int x){
+    while(parent[x] != x){
+        parent[x] = parent[parent[x]];
+        x = parent[x];
     }
-    return;
+    return x;
 }
 
-void hysteresis(image& img, std::vector<coord> slist){
-    bool** visited = new bool*[img.r()];
-    for(int i = 0; i < img.r(); i++){
-       visited[i] = new bool[img.c()];
-        for(int j = 0; j < img.c(); j++){
-            visited[i][j] = false;
+//Roots always have the smaller index, so parent[x] <= x holds for every run.
+static void join(std::vector<int>& parent, int a, int b){
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if(a < b) parent[b] = a;
+    else if(b < a) parent[a] = b;
+}
+
+//Union every run in row <i> with the runs it touches (including diagonally) in row i-1.
+static void join_rows(std::vector<int>& parent, const std::vector<run>& runs, const std::vector<int>& begin, int i){
+    int a = begin[i - 1];
+    for(int b = begin[i]; b < begin[i + 1]; b++){
+        while(a < begin[i] && runs[a].end < runs[b].start) a++;
+        for(int k = a; k < begin[i] && runs[k].start <= runs[b].end; k++){
+            join(parent, k, b);
         }
     }
+}
 
-    for(int i = 0; i < slist.size(); i++){
-        //start a chain IFF the pixel is strong.
-        if(img[slist[i].row][slist[i].col].y == 1.0) chain(img, slist[i].row, slist[i].col, visited);
+//Split a row of the packed candidate mask into runs of set bits.
+static void row_runs(const uint64_t* cand, const uint64_t* strong, int words, std::vector<run>& out){
+    int j = 0;
+    const int bits = words * 64;
+    while(j < bits){
+        int w = j >> 6;
+        uint64_t word = cand[w] & (~0ull << (j & 63));
+        while(!word && ++w < words) word = cand[w];
+        if(w >= words) return;
+        int start = w * 64 + __builtin_ctzll(word);
+        //find the first clear bit at or after <start>
+        w = start >> 6;
+        word = ~cand[w] & (~0ull << (start & 63));
+        while(!word && ++w < words) word = ~cand[w];
+        int end = w >= words ? bits : w * 64 + __builtin_ctzll(word);
+        bool s = false;
+        for(int k = start >> 6; k <= (end - 1) >> 6 && !s; k++){
+            uint64_t mask = ~0ull;
+            if(k == start >> 6) mask &= ~0ull << (start & 63);
+            if(k == (end - 1) >> 6 && (end & 63)) mask &= ~0ull >> (64 - (end & 63));
+            s = strong[k] & mask;
+        }
+        out.push_back(run{start, end, s});
+        j = end;
     }
-    for(int i = 0; i < img.r(); i++){
-        delete[] visited[i];
+}
+
+//Cut rows [first, last) of <classes> into runs of candidate pixels and join the runs into
+//8-connected components. Afterwards row i - first holds runs [s.begin[i - first], s.begin[i - first + 1])
+//of s.runs, every s.parent entry is the root of its run's component, and s.keep is set at the roots of
+//the components that hold a strong pixel.
+void label_runs(const plane<uint8_t>& classes, int first, int last, canny_scratch& s){
+    const int h = last - first;
+    const int w = classes.c();
+    const int words = (w + 63) / 64;
+    s.cand.reshape(h, w);
+    s.strong.reshape(h, w);
+    s.rowruns.resize(h);
+    parallel_rows(h, [&](int top, int bottom){
+        for(int i = top; i < bottom; i++){
+            const uint8_t* src = classes[first + i];
+            uint64_t* c = s.cand[i];
+            uint64_t* st = s.strong[i];
+            for(int k = 0; k < words; k++){
+                uint64_t cw = 0, sw = 0;
+                for(int j = k * 64; j < std::min(w, k * 64 + 64); j++){
+                    cw |= uint64_t(src[j] >= EDGE_CANDIDATE) << (j & 63);
+                    sw |= uint64_t(src[j] == EDGE_STRONG) << (j & 63);
+                }
+                c[k] = cw;
+                st[k] = sw;
+            }
+            s.rowruns[i].clear();
+            row_runs(c, st, words, s.rowruns[i]);
+        }
+    });
+
+    //number the runs row by row
+    std::vector<int>& begin = s.begin;
+    std::vector<run>& runs = s.runs;
+    std::vector<int>& parent = s.parent;
+    begin.assign(h + 1, 0);
+    for(int i = 0; i < h; i++) begin[i + 1] = begin[i] + s.rowruns[i].size();
+    runs.resize(begin[h]);
+    parent.resize(begin[h]);
+    parallel_rows(h, [&](int top, int bottom){
+        for(int i = top; i < bottom; i++){
+            std::copy(s.rowruns[i].begin(), s.rowruns[i].end(), runs.begin() + begin[i]);
+            for(int k = begin[i]; k < begin[i + 1]; k++) parent[k] = k;
+        }
+    });
+
+    //label inside each tile, then stitch the seams between tiles
+    const int tiles = (h + HYSTERESIS_TILE - 1) / HYSTERESIS_TILE;
+    parallel_for(tiles, [&](int t){
+        int bottom = std::min(h, (t + 1) * HYSTERESIS_TILE);
+        for(int i = t * HYSTERESIS_TILE + 1; i < bottom; i++) join_rows(parent, runs, begin, i);
+    });
+    for(int t = 1; t < tiles; t++) join_rows(parent, runs, begin, t * HYSTERESIS_TILE);
+
+    //flatten every run onto its root and mark the components that hold a strong pixel
+    std::vector<char>& keep = s.keep;
+    keep.assign(runs.size(), 0);
+    for(size_t k = 0; k < runs.size(); k++){
+        parent[k] = parent[parent[k]];
+        if(runs[k].strong) keep[parent[k]] = 1;
     }
-    delete[] visited;
-    //remove any unconnected weak edges
-    threshold(img, 1.0);
+}
+
+//The runs of the components that label_runs() marked to keep, as an edge mask <cols> wide.
+void kept_runs(const canny_scratch& s, int cols, edge_mask& mask){
+    const std::vector<int>& begin = s.begin;
+    const std::vector<run>& runs = s.runs;
+    const std::vector<int>& parent = s.parent;
+    const std::vector<char>& keep = s.keep;
+    const int h = begin.size() - 1;
+    mask.rows = h;
+    mask.cols = cols;
+    mask.begin.assign(h + 1, 0);
+    parallel_rows(h, [&](int first, int last){
+        for(int i = first; i < last; i++){
+            for(int k = begin[i]; k < begin[i + 1]; k++) mask.begin[i + 1] += keep[parent[k]];
+        }
+    });
+    for(int i = 0; i < h; i++) mask.begin[i + 1] += mask.begin[i];
+    mask.runs.resize(mask.begin[h]);
+    parallel_rows(h, [&](int first, int last){
+        for(int i = first; i < last; i++){
+            int n = mask.begin[i];
+            for(int k = begin[i]; k < begin[i + 1]; k++){
+                if(keep[parent[k]]) mask.runs[n++] = edge_run{runs[k].start, runs[k].end};
+            }
+        }
+    });
+}
+
+//Edges that survive hysteresis among the EDGE_* classes of a thresholded image, as runs. Every
+//buffer, including those of <mask>, keeps its capacity from earlier calls.
+void trace_edges(const plane<uint8_t>& classes, canny_scratch& s, edge_mask& mask){
+    TRACE("hysteresis");
+    label_runs(classes, 0, classes.r(), s);
+    kept_runs(s, classes.c(), mask);
+}
+
+edge_mask trace_edges(const plane<uint8_t>& classes){
+    canny_scratch s;
+    edge_mask mask;
+    trace_edges(classes, s, mask);
+    return mask;
+}
+
+template<typename T>
+static void rasterize(const edge_mask& mask, basic_image<T>& img, T on){
+    TRACE("draw_edges");
+    parallel_rows(mask.rows, [&](int first, int last){
+        for(int i = first; i < last; i++){
+            T* dst = img[i];
+            std::fill(dst, dst + mask.cols, T(0));
+            for(int k = mask.begin[i]; k < mask.begin[i + 1]; k++){
+                std::fill(dst + mask.runs[k].start, dst + mask.runs[k].end, on);
+            }
+        }
+    });
+}
+
+//Rasterize <mask> into <img>: 1 on edges, 0 elsewhere.
+void draw_edges(const edge_mask& mask, image& img){
+    rasterize(mask, img, 1.0f);
+}
+
+//Integer images get their maxval on edges.
+void draw_edges(const edge_mask& mask, image8& img){
+    rasterize(mask, img, uint8_t(img.get_maxval()));
+}
+
+//Keep the pixels of a thresholded image (strong 1, candidates 1/2) that survive hysteresis.
+void hysteresis(image& img){
+    draw_edges(trace_edges(threshold(img, 0.5, 1.0)), img);
 }
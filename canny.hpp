@@ -1,9 +1,68 @@
 #pragma once
 
+#include <cstdint>
+#include <vector>
+
+#include "image.hpp"
 #include "imgutils.hpp"
 
-image canny(const image&);
-image threshold(const image&, double, double, std::vector<coord>&);
+//Quantized gradient directions produced by gradient()
+enum { DIR_0, DIR_45, DIR_90, DIR_135 };
+
+//Pixel classes produced by the double threshold
+enum { EDGE_WEAK, EDGE_CANDIDATE, EDGE_STRONG };
+
+//Edge pixels as runs of columns, row by row. Row i holds runs [begin[i], begin[i + 1]), in order and
+//never touching each other.
+struct edge_run{
+    int start, end;     //columns [start, end)
+};
+
+struct edge_mask{
+    int rows, cols;
+    std::vector<int> begin;
+    std::vector<edge_run> runs;
+};
+
+//A run of candidate pixels found during hysteresis, and whether it holds a strong pixel.
+struct candidate_run{
+    int start, end;     //columns [start, end)
+    bool strong;
+};
+
+//Buffers for the intermediates of canny_edges(). Keeping one between calls, as the batch and frame
+//modes do, means that images of the same size are processed without allocating. Each buffer uses the
+//narrowest type that holds its values: thresholded pixels take a byte and the hysteresis masks a bit.
+struct canny_scratch{
+    image smooth;
+    image mag;
+    plane<uint8_t> dir;
+    plane<uint8_t> classes;         //EDGE_* class of every pixel
+    bit_plane cand, strong;         //candidate or strong pixels, and strong pixels alone
+    std::vector<std::vector<candidate_run> > rowruns;
+    std::vector<candidate_run> runs;
+    std::vector<int> begin, parent;
+    std::vector<char> keep;
+};
+
+image8 canny(const image&);
+void canny(const image&, image8& out, canny_scratch&, edge_mask&);
+void edge_image(const edge_mask&, image8& out);
+edge_mask canny_edges(const image&);
+void canny_edges(const image&, canny_scratch&, edge_mask&);
+plane<uint8_t> threshold(const image&, double, double);
+void threshold(const image&, plane<uint8_t>& out, double, double);
 void threshold_values(const image&, double&, double&);
-image nmsuppression(const matrix&, const image&);
-void hysteresis(image&, std::vector<coord>);
+void magnitude_sums(const float* row, int w, double& sum, int& num);
+void magnitude_sums(const float* row, int w, double average, double& wsum, int& wnum, double& ssum, int& snum);
+void gradient(const plane<float>&, plane<float>&, plane<uint8_t>&);
+image nmsuppression(const plane<uint8_t>&, const image&);
+void nmsuppression(const plane<uint8_t>&, const image& mag, image& out);
+void nmsuppression(const plane<uint8_t>&, const image& mag, double, double, plane<uint8_t>& out);
+void hysteresis(image&);
+edge_mask trace_edges(const plane<uint8_t>&);
+void trace_edges(const plane<uint8_t>&, canny_scratch&, edge_mask&);
+void label_runs(const plane<uint8_t>&, int first, int last, canny_scratch&);
+void kept_runs(const canny_scratch&, int cols, edge_mask&);
+void draw_edges(const edge_mask&, image&);
+void draw_edges(const edge_mask&, image8&);
@@ -0,0 +1,158 @@
+#include <cstdlib>
+#include <sstream>
+
+#include "chain.hpp"
+#include "image.hpp"
+#include "imgutils.hpp"
+#include "threads.hpp"
+#include "trace.hpp"
+
+//----------------------------------------------[Parsing]-------------------------------------------
+
+std::string chain_help(){
+    return "gaussian[:sigma], edges, sort[:mode[:key]], jitter:N, dither[:levels], sdither, remap:a:b, clip, "
+           "threshold[:v], quantize:levels";
+}
+
+static bool number(const std::string& s, double& v){
+    char* end;
+    v = strtod(s.c_str(), &end);
+    return !s.empty() && !*end;
+}
+
+//Stages are separated by commas and their arguments by colons, e.g. "gaussian,edges,sort:columns".
+//Consecutive per-sample stages are merged into one CHAIN_POINTWISE stage as they are read.
+bool parse_chain(const std::string& spec, std::vector<chain_stage>& chain){
+    chain.clear();
+    std::stringstream list(spec);
+    std::string item;
+    while(std::getline(list, item, ',')){
+        std::vector<std::string> arg;
+        std::stringstream parts(item);
+        std::string part;
+        while(std::getline(parts, part, ':')) arg.push_back(part);
+        if(arg.empty()) return false;
+        const std::string& name = arg[0];
+        const size_t n = arg.size() - 1;
+        double x, y;
+        chain_stage st;
+        point_op op = {POINT_CLIP, 0, 0};
+        bool point = false;
+        if(name == "gaussian" && n <= 1){
+            st.kind = CHAIN_GAUSSIAN;
+            if(n == 1 && !(number(arg[1], x) && x > 0 && x <= 1000)) return false;
+            st.sigma = n ? x : 0;
+        }
+        else if(name == "edges" && n == 0) st.kind = CHAIN_EDGES;
+        else if(name == "sdither" && n == 0) st.kind = CHAIN_SDITHER;
+        else if(name == "sort" && n <= 2){
+            st.kind = CHAIN_SORT;
+            if(n >= 1 && !parse_sort_mode(arg[1], st.sort.angle)) return false;
+            if(n == 2 && !find_sort_key(arg[2], st.sort.key)) return false;
+        }
+        else if(name == "jitter" && n == 1 && number(arg[1], x) && x >= 0){
+            st.kind = CHAIN_JITTER;
+            st.radius = int(x);
+        }
+        else if(name == "dither" && n <= 1){
+            st.kind = CHAIN_DITHER;
+            if(n == 1 && !(number(arg[1], x) && x >= 2 && x <= 256)) return false;
+            st.levels = n ? int(x) : 0;
+        }
+        else if(name == "remap" && n == 2 && number(arg[1], x) && number(arg[2], y) && x != y){
+            op = point_op{POINT_REMAP, x, y};
+            point = true;
+        }
+        else if(name == "clip" && n == 0){
+            op = point_op{POINT_CLIP, 0, 0};
+            point = true;
+        }
+        else if(name == "threshold" && n <= 1){
+            if(n == 1 && !number(arg[1], x)) return false;
+            op = point_op{POINT_THRESHOLD, n ? x : 0.5, 0};
+            point = true;
+        }
+        else if(name == "quantize" && n == 1 && number(arg[1], x) && x >= 2 && x <= 65536){
+            op = point_op{POINT_QUANTIZE, double(int(x)), 0};
+            point = true;
+        }
+        else return false;
+
+        if(!point){
+            chain.push_back(st);
+            continue;
+        }
+        if(chain.empty() || chain.back().kind != CHAIN_POINTWISE){
+            st.kind = CHAIN_POINTWISE;
+            chain.push_back(st);
+        }
+        chain.back().ops.push_back(op);
+    }
+    return !chain.empty();
+}
+
+//--------------------------------------------[Pointwise]-------------------------------------------
+
+//One operation over <n> samples. Each case is a plain loop over the row, which the compiler vectorizes.
+static void apply_op(const point_op& op, float* row, int n){
+    switch(op.kind){
+        case POINT_REMAP:{
+            //as remap()
+            const float a = op.a;
+            const float scale = 1.0 / (op.b - op.a);
+            for(int j = 0; j < n; j++) row[j] = (row[j] - a) * scale;
+            break;
+        }
+        case POINT_CLIP:
+            for(int j = 0; j < n; j++) row[j] = MIN(MAX(0.0f, row[j]), 1.0f);
+            break;
+        case POINT_THRESHOLD:
+            for(int j = 0; j < n; j++) row[j] = row[j] >= op.a ? 1.0f : 0.0f;
+            break;
+        case POINT_QUANTIZE:{
+            //round to the nearest of <levels> evenly spaced values in [0, 1]. Clamping after the
+            //scale keeps the loop vectorizable, and truncation rounds down once v is positive.
+            const float steps = op.a - 1;
+            const float inv = 1.0f / steps;
+            for(int j = 0; j < n; j++){
+                float v = row[j] * steps;
+                v = v > 0.0f ? v : 0.0f;
+                v = v < steps ? v : steps;
+                row[j] = int(v + 0.5f) * inv;
+            }
+            break;
+        }
+    }
+}
+
+//Apply <ops> in order to every sample. Each row goes through all of them while it is still in cache,
+//so a run of per-sample stages costs one pass over the image however long it is. Colour images are
+//worked on channel by channel and their luma is then taken from the result, row by row. Threshold and
+//quantize work on luma, as threshold() and the gray dithers do, so from the first of them on a colour
+//image becomes gray.
+void pointwise(image& img, const std::vector<point_op>& ops){
+    TRACE("pointwise");
+    const bool color = img.color();
+    //ops before <split> run on every channel of a colour image, the rest on luma
+    size_t split = 0;
+    while(color && split < ops.size() && ops[split].kind != POINT_THRESHOLD && ops[split].kind != POINT_QUANTIZE){
+        split++;
+    }
+    parallel_rows(img.r(), [&](int first, int last){
+        if(color){
+            for(int i = first; i < last; i++){
+                for(int p = 0; p < 3; p++){
+                    for(size_t k = 0; k < split; k++) apply_op(ops[k], img.channel(p)[i], img.c());
+                }
+            }
+            img.update_luma(first, last);
+        }
+        for(int i = first; i < last; i++){
+            for(size_t k = split; k < ops.size(); k++) apply_op(ops[k], img[i], img.c());
+        }
+    });
+    if(color && split < ops.size()){
+        img.set_color(false);
+        img.set_format("P2");
+    }
+}
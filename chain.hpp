@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "pixelsort.hpp"
+
+template<typename T> class basic_image;
+typedef basic_image<float> image;
+
+//---------------------------------------------[Chains]---------------------------------------------
+
+//A per-sample operation of a chain. Runs of them are fused into one stage that makes a single pass
+//over the image.
+enum point_kind { POINT_REMAP, POINT_CLIP, POINT_THRESHOLD, POINT_QUANTIZE };
+
+struct point_op{
+    point_kind kind;
+    double a, b;                    //remap: [a, b] -> [0, 1]; threshold: a; quantize: a levels
+};
+
+enum chain_kind { CHAIN_GAUSSIAN, CHAIN_EDGES, CHAIN_SORT, CHAIN_JITTER, CHAIN_DITHER, CHAIN_SDITHER, CHAIN_POINTWISE };
+
+//One stage of an effect chain given with --chain.
+struct chain_stage{
+    chain_kind kind;
+    int levels = 0;                 //CHAIN_DITHER: gray levels, or 0 for the palette given with -p
+    int radius = 0;                 //CHAIN_JITTER
+    double sigma = 0;               //CHAIN_GAUSSIAN: deviation, or 0 for the fixed 5x5 kernel
+    sort_options sort;              //CHAIN_SORT
+    std::vector<point_op> ops;      //CHAIN_POINTWISE, applied in order
+};
+
+bool parse_chain(const std::string& spec, std::vector<chain_stage>&);
+std::string chain_help();
+void pointwise(image&, const std::vector<point_op>&);
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <vector>
+
+#include "image.hpp"
+#include "threads.hpp"
+
+//--------------------------------------[Convolution Engine]----------------------------------------
+
+//Kernel sizes are template parameters so that the tap loops are fully unrolled. A size of 0 means
+//the size is only known at run time and is passed in instead. Kernels are centred on tap (n-1)/2 and
+//edge pixels are extended to infinity.
+//
+//Every pass splits a row into a border strip on each side, where source coordinates are clamped, and
+//an interior where they never leave the image. The interior loops run tap-by-tap over contiguous
+//rows, which the compiler turns into straight SIMD code.
+
+static inline int clamp_index(int i, int n){
+    return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+//One output sample of a row pass with clamped source columns. Only used in the border strips.
+static inline float clamped_tap(const float* in, const float* k, int n, int R, int w, int j){
+    float acc = 0;
+    for(int t = 0; t < n; t++) acc += k[t] * in[clamp_index(j + t - R, w)];
+    return acc;
+}
+
+//Horizontal 1-D pass over rows [r0, r1).
+template<int N>
+void convolve_h(view<const float> src, view<float> dst, const float* k, int kn, int r0, int r1){
+    const int n = N ? N : kn;
+    const int R = (n - 1) / 2;
+    const int w = src.c();
+    const int lo = R < w ? R : w;
+    const int hi = w - (n - 1 - R) > lo ? w - (n - 1 - R) : lo;
+    for(int i = r0; i < r1; i++){
+        const float* __restrict in = src[i];
+        float* __restrict out = dst[i];
+        for(int j = lo; j < hi; j++) out[j] = k[0] * in[j - R];
+        for(int t = 1; t < n; t++){
+            const float kt = k[t];
+            const float* __restrict s = in + t - R;
+            for(int j = lo; j < hi; j++) out[j] += kt * s[j];
+        }
+        for(int j = 0; j < lo; j++) out[j] = clamped_tap(in, k, n, R, w, j);
+        for(int j = hi; j < w; j++) out[j] = clamped_tap(in, k, n, R, w, j);
+    }
+}
+
+//Vertical taps for one output row. <in> holds the n source rows, already clamped to the image.
+template<int N>
+inline void filter_column(const float* const* in, float* __restrict out, const float* k, int kn, int w){
+    const int n = N ? N : kn;
+    const float* __restrict s = in[0];
+    for(int j = 0; j < w; j++) out[j] = k[0] * s[j];
+    for(int t = 1; t < n; t++){
+        const float kt = k[t];
+        s = in[t];
+        for(int j = 0; j < w; j++) out[j] += kt * s[j];
+    }
+}
+
+//Vertical 1-D pass over rows [r0, r1). Clamping only selects which source rows to read, so every
+//row of the output is computed without any per-pixel bounds checks.
+template<int N>
+void convolve_v(view<const float> src, view<float> dst, const float* k, int kn, int r0, int r1){
+    const int n = N ? N : kn;
+    const int R = (n - 1) / 2;
+    const float* fixed[N ? N : 1];
+    std::vector<const float*> sized(N ? 0 : n);
+    const float** in = N ? fixed : sized.data();
+    for(int i = r0; i < r1; i++){
+        for(int t = 0; t < n; t++) in[t] = src[clamp_index(i + t - R, src.r())];
+        filter_column<N>(in, dst[i], k, n, src.c());
+    }
+}
+
+//Full 2-D pass for kernels that are not separable. <k> is row-major, H rows by W columns.
+template<int H, int W>
+void convolve_2d(view<const float> src, view<float> dst, const float* k, int kh, int kw, int r0, int r1){
+    const int h = H ? H : kh;
+    const int n = W ? W : kw;
+    const int RY = (h - 1) / 2;
+    const int R = (n - 1) / 2;
+    const int w = src.c();
+    const int lo = R < w ? R : w;
+    const int hi = w - (n - 1 - R) > lo ? w - (n - 1 - R) : lo;
+    for(int i = r0; i < r1; i++){
+        float* __restrict out = dst[i];
+        for(int j = 0; j < w; j++) out[j] = 0;
+        for(int y = 0; y < h; y++){
+            const float* __restrict in = src[clamp_index(i + y - RY, src.r())];
+            const float* ky = k + y * n;
+            for(int t = 0; t < n; t++){
+                const float kt = ky[t];
+                const float* __restrict s = in + t - R;
+                for(int j = lo; j < hi; j++) out[j] += kt * s[j];
+            }
+            for(int j = 0; j < lo; j++) out[j] += clamped_tap(in, ky, n, R, w, j);
+            for(int j = hi; j < w; j++) out[j] += clamped_tap(in, ky, n, R, w, j);
+        }
+    }
+}
+
+//Separable convolution of output rows [r0, r1): the horizontal pass with <kx> fills a band-local
+//temporary that includes the vertical halo, then the vertical pass with <ky> reads from it. Bands
+//computed this way only overlap in their halo rows. The temporary belongs to the thread and is
+//sized for a full band with both halos, so it is only reallocated when the width or band size grows.
+template<int NX, int NY>
+void convolve_band(view<const float> src, view<float> dst, const float* kx, const float* ky,
+                   int nx, int ny, int r0, int r1){
+    const int n = NY ? NY : ny;
+    const int R = (n - 1) / 2;
+    const int t0 = clamp_index(r0 - R, src.r());
+    const int t1 = clamp_index(r1 - 1 + n - 1 - R, src.r()) + 1;
+    static thread_local plane<float> temp;
+    if(temp.r() < r1 - r0 + n - 1 || temp.c() != src.c()) temp = plane<float>(r1 - r0 + n - 1, src.c());
+    convolve_h<NX>(src.sub(t0, 0, t1 - t0, src.c()), temp.all(), kx, nx, 0, t1 - t0);
+    const float* fixed[NY ? NY : 1];
+    std::vector<const float*> sized(NY ? 0 : n);
+    const float** in = NY ? fixed : sized.data();
+    for(int i = r0; i < r1; i++){
+        for(int t = 0; t < n; t++) in[t] = temp[clamp_index(i + t - R, src.r()) - t0];
+        filter_column<NY>(in, dst[i], ky, n, src.c());
+    }
+}
+
+template<int NX, int NY>
+void convolve_separable(const plane<float>& src, plane<float>& dst, const float* kx, const float* ky,
+                        int nx = NX, int ny = NY){
+    parallel_rows(src.r(), [&](int r0, int r1){
+        convolve_band<NX, NY>(src.all(), dst.all(), kx, ky, nx, ny, r0, r1);
+    });
+}
@@ -0,0 +1,236 @@
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+#include "diffusion.hpp"
+#include "image.hpp"
+#include "imgutils.hpp"
+#include "threads.hpp"
+#include "trace.hpp"
+
+//--------------------------------------[Diffusion Kernels]-----------------------------------------
+
+static const diffusion_kernel kernels[] = {
+    {"floyd-steinberg", 16, {{0, 1, 7}, {1, -1, 3}, {1, 0, 5}, {1, 1, 1}}},
+    {"atkinson", 8, {{0, 1, 1}, {0, 2, 1}, {1, -1, 1}, {1, 0, 1}, {1, 1, 1}, {2, 0, 1}}},
+    {"jarvis", 48, {{0, 1, 7}, {0, 2, 5},
+                    {1, -2, 3}, {1, -1, 5}, {1, 0, 7}, {1, 1, 5}, {1, 2, 3},
+                    {2, -2, 1}, {2, -1, 3}, {2, 0, 5}, {2, 1, 3}, {2, 2, 1}}},
+    {"stucki", 42, {{0, 1, 8}, {0, 2, 4},
+                    {1, -2, 2}, {1, -1, 4}, {1, 0, 8}, {1, 1, 4}, {1, 2, 2},
+                    {2, -2, 1}, {2, -1, 2}, {2, 0, 4}, {2, 1, 2}, {2, 2, 1}}},
+    {"sierra", 32, {{0, 1, 5}, {0, 2, 3},
+                    {1, -2, 2}, {1, -1, 4}, {1, 0, 5}, {1, 1, 4}, {1, 2, 2},
+                    {2, -1, 2}, {2, 0, 3}, {2, 1, 2}}},
+};
+
+//Number of rows the kernel spans, including the current one.
+int diffusion_kernel::rows() const {
+    int n = 1;
+    for(const tap& t : taps) n = MAX(n, t.dy + 1);
+    return n;
+}
+
+//How far the kernel reaches to the left on the rows below, and to the right on any row.
+int diffusion_kernel::left() const {
+    int n = 0;
+    for(const tap& t : taps) n = MAX(n, -t.dx);
+    return n;
+}
+
+int diffusion_kernel::right() const {
+    int n = 0;
+    for(const tap& t : taps) n = MAX(n, t.dx);
+    return n;
+}
+
+const diffusion_kernel& floyd_steinberg(){
+    return kernels[0];
+}
+
+const diffusion_kernel* find_kernel(const std::string& name){
+    for(const diffusion_kernel& k : kernels){
+        if(k.name == name) return &k;
+    }
+    return nullptr;
+}
+
+std::string kernel_names(){
+    std::string names;
+    for(const diffusion_kernel& k : kernels){
+        if(!names.empty()) names += ", ";
+        names += k.name;
+    }
+    return names;
+}
+
+//--------------------------------------------[Palettes]--------------------------------------------
+
+#define LUT_BITS 5
+#define LUT_SIZE (1 << LUT_BITS)
+
+bool palette::color() const {
+    return !colors.empty();
+}
+
+//Nearest gray level, in constant time. Exact ties go to the darker level. With <ceiling> set, values
+//are rounded up to the next level instead.
+double palette::level(double v) const {
+    double x = v * (levels - 1);
+    double k = ceiling ? ceil(x) : ceil(x - 0.5);
+    k = MAX(k, 0.0);
+    k = MIN(k, double(levels - 1));
+    return k / (levels - 1);
+}
+
+static inline int lut_cell(float v){
+    int i = int(v * LUT_SIZE);
+    return i < 0 ? 0 : (i >= LUT_SIZE ? LUT_SIZE - 1 : i);
+}
+
+//Index of the colour closest to the centre of the table cell holding (r, g, b).
+int palette::nearest(float r, float g, float b) const {
+    return lut[(lut_cell(r) << (2 * LUT_BITS)) | (lut_cell(g) << LUT_BITS) | lut_cell(b)];
+}
+
+palette gray_palette(int levels, bool ceiling){
+    palette p;
+    p.levels = MAX(levels, 2);
+    p.ceiling = ceiling;
+    return p;
+}
+
+//Parses a comma separated list of hex colours such as "#000000,#ff0000,00ff00" and builds the
+//nearest-colour table. Returns false if the list is malformed.
+bool rgb_palette(const std::string& spec, palette& p){
+    p = gray_palette(2);
+    std::stringstream ss(spec);
+    std::string item;
+    while(std::getline(ss, item, ',')){
+        if(!item.empty() && item[0] == '#') item.erase(0, 1);
+        if(item.size() != 6 || item.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos){
+            return false;
+        }
+        long v = strtol(item.c_str(), nullptr, 16);
+        p.colors.push_back(((v >> 16) & 0xff) / 255.0f);
+        p.colors.push_back(((v >> 8) & 0xff) / 255.0f);
+        p.colors.push_back((v & 0xff) / 255.0f);
+    }
+    const int n = p.colors.size() / 3;
+    if(n == 0 || n > 65535) return false;
+    p.lut.resize(LUT_SIZE * LUT_SIZE * LUT_SIZE);
+    for(int cell = 0; cell < int(p.lut.size()); cell++){
+        float r = ((cell >> (2 * LUT_BITS)) + 0.5f) / LUT_SIZE;
+        float g = (((cell >> LUT_BITS) & (LUT_SIZE - 1)) + 0.5f) / LUT_SIZE;
+        float b = ((cell & (LUT_SIZE - 1)) + 0.5f) / LUT_SIZE;
+        float best = 4;
+        for(int k = 0; k < n; k++){
+            float dr = r - p.colors[3*k], dg = g - p.colors[3*k + 1], db = b - p.colors[3*k + 2];
+            float d = dr * dr + dg * dg + db * db;
+            if(d < best){
+                best = d;
+                p.lut[cell] = k;
+            }
+        }
+    }
+    return true;
+}
+
+//--------------------------------------------[Dithering]-------------------------------------------
+
+//Rows publish their progress in steps of this many pixels.
+#define DITHER_STEP 16
+#define MAX_KERNEL_ROWS 4
+
+//Error diffusion run as a skewed wavefront, one row per task. Row i+1 may quantize pixel j once row
+//i is <lag> pixels ahead of it: by then every error term row i adds to the pixels row i+1 is about
+//to touch has landed, in the same order as in a serial raster scan. Each row publishes how far it
+//has got in an atomic counter, so threads never take a lock and the result is the same for any
+//thread count.
+//
+//Pixel values plus accumulated error live in a ring of (threads + kernel rows) scratch rows per
+//channel. A row loads the source row that the kernel's bottom edge is about to reach into its ring
+//slot, after waiting for the row that last used the slot to finish.
+template<int C, typename Q>
+static void run(image& img, const diffusion_kernel& k, Q quantize){
+    const int h = img.r();
+    const int w = img.c();
+    const int H = k.rows();
+    const int lag = k.left() + k.right() + 1;
+    const int S = thread_count() + H;
+    plane<float>* src[C];
+    plane<float> ring[C];
+    for(int c = 0; c < C; c++){
+        src[c] = C == 1 ? &img.y() : &img.channel(c);
+        ring[c] = plane<float>(S, w);
+    }
+    std::unique_ptr<std::atomic<int>[]> done(new std::atomic<int>[h]);
+    for(int i = 0; i < h; i++) done[i] = 0;
+    auto load = [&](int row){
+        for(int c = 0; c < C; c++) memcpy(ring[c][row % S], (*src[c])[row], w * sizeof(float));
+    };
+    for(int row = 0; row < H - 1 && row < h; row++) load(row);
+
+    parallel_for(h, [&](int i){
+        const int fill = i + H - 1;
+        if(fill < h){
+            if(fill >= S){
+                while(done[fill - S].load(std::memory_order_acquire) < w) std::this_thread::yield();
+            }
+            load(fill);
+        }
+        float* rows[C][MAX_KERNEL_ROWS];
+        float* out[C];
+        for(int c = 0; c < C; c++){
+            out[c] = (*src[c])[i];
+            for(int dy = 0; dy < H; dy++) rows[c][dy] = i + dy < h ? ring[c][(i + dy) % S] : nullptr;
+        }
+        int ready = i ? 0 : w;  //progress of the row above, as last seen
+        for(int j = 0; j < w; j++){
+            const int need = MIN(j + lag, w);
+            while(ready < need){
+                ready = done[i - 1].load(std::memory_order_acquire);
+                if(ready < need) std::this_thread::yield();
+            }
+            double oldpixel[C], newpixel[C];
+            for(int c = 0; c < C; c++) oldpixel[c] = rows[c][0][j];
+            quantize(oldpixel, newpixel);
+            for(int c = 0; c < C; c++){
+                out[c][j] = newpixel[c];
+                double q_error = oldpixel[c] - newpixel[c];
+                for(const tap& t : k.taps){
+                    int x = j + t.dx;
+                    if(x < 0 || x >= w || !rows[c][t.dy]) continue;
+                    rows[c][t.dy][x] += q_error * t.weight / k.divisor;
+                }
+            }
+            if((j + 1) % DITHER_STEP == 0 || j == w - 1){
+                done[i].store(j + 1, std::memory_order_release);
+            }
+        }
+    });
+}
+
+//Dither <img> in place to the colours of <pal> using kernel <k>. Gray palettes leave a grayscale
+//image behind; colour palettes leave a colour image.
+void diffuse(image& img, const diffusion_kernel& k, const palette& pal){
+    TRACE("diffuse");
+    if(pal.color()){
+        img.set_color(true);
+        run<3>(img, k, [&pal](const double* in, double* out){
+            int n = pal.nearest(in[0], in[1], in[2]);
+            for(int c = 0; c < 3; c++) out[c] = pal.colors[3*n + c];
+        });
+        img.update_luma();
+    }
+    else{
+        img.set_color(false);
+        run<1>(img, k, [&pal](const double* in, double* out){
+            out[0] = pal.level(in[0]);
+        });
+    }
+}
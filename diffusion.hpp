@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+template<typename T> class basic_image;
+typedef basic_image<float> image;
+
+//--------------------------------------[Diffusion Kernels]-----------------------------------------
+
+//One entry of an error diffusion kernel: <weight>/divisor of the error goes to the pixel <dy> rows
+//down and <dx> columns across.
+struct tap{
+    int dy, dx, weight;
+};
+
+struct diffusion_kernel{
+    std::string name;
+    int divisor;
+    std::vector<tap> taps;
+    int rows() const;
+    int left() const;
+    int right() const;
+};
+
+const diffusion_kernel& floyd_steinberg();
+const diffusion_kernel* find_kernel(const std::string&);
+std::string kernel_names();
+
+//--------------------------------------------[Palettes]--------------------------------------------
+
+//Either <levels> evenly spaced gray levels, or a list of RGB colours. Gray levels are looked up
+//arithmetically; colours go through a 32x32x32 table of nearest entries.
+struct palette{
+    int levels;
+    bool ceiling;                   //round gray values up to the next level instead of to the nearest
+    std::vector<float> colors;      //r, g, b triples in [0, 1]
+    std::vector<uint16_t> lut;
+
+    bool color() const;
+    double level(double v) const;
+    int nearest(float r, float g, float b) const;
+};
+
+palette gray_palette(int levels, bool ceiling = false);
+bool rgb_palette(const std::string& spec, palette&);
+
+//--------------------------------------------[Dithering]-------------------------------------------
+
+void diffuse(image&, const diffusion_kernel&, const palette&);
@@ -1,175 +1,108 @@
 #include <algorithm>
+#include <cstdlib>
+#include <cmath>
 #include <iostream>
+#include <utility>
+#include <vector>
 
-#include <sys/ioctl.h> //ioctl() and TIOCGWINSZ
-#include <unistd.h> // for STDOUT_FILENO
-
+#include "diffusion.hpp"
 #include "effects.hpp"
 #include "image.hpp"
 #include "imgutils.hpp"
+#include "rng.hpp"
+#include "threads.hpp"
+#include "trace.hpp"
 
-//stochastic dither
-image sdither(const image& img){
-    image out(img.r(), img.c());
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            out[i][j] = pixel(img[i][j].y * 1000 > rand() % 1000);
-            //out[i][j] = pixel(img[i][j].y);
+//stochastic dither, to samples of 0 or <on>
+//Every row draws from its own stream of the seeded generator, so rows can be processed in parallel
+//and the result does not depend on how they are split between threads.
+template<typename T>
+static void stochastic(const image& img, basic_image<T>& out, T on){
+    TRACE("sdither");
+    out.reshape(img.r(), img.c(), false);
+    out.set_maxval(255);
+    const uint64_t seed = get_seed();
+    parallel_rows(img.r(), [&](int first, int last){
+        for(int i = first; i < last; i++){
+            const float* src = img[i];
+            T* dst = out[i];
+            xoshiro rng(seed, i);
+            for(int j = 0; j < img.c(); j++){
+                dst[j] = src[j] > rng.unit() ? on : T(0);
+            }
         }
-    }
+    });
     out.set_format("P2");
-    return out;
 }
 
-//floyd-steinberg dither
-void dither(image& img){
-    pixel oldpixel;
-    pixel newpixel;
-    double q_error;
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            oldpixel = img[i][j];
-            newpixel = pixel(oldpixel.y > 0.5);
-            img[i][j] = newpixel;
-            q_error = oldpixel.y - newpixel.y;
-            if (j < img.c() - 1)            img[i  ][j+1].y += q_error * 7.0 / 16.0;
-            if (j > 0 && i < img.r() - 1)   img[i+1][j-1].y += q_error * 3.0 / 16.0;
-            if (i < img.r() - 1)            img[i+1][j  ].y += q_error * 5.0 / 16.0;
-            if (i<img.r()-1 && j<img.c()-1) img[i+1][j+1].y += q_error * 1.0 / 16.0;
-        }
-    }
-    img.set_format("P1");
+//8-bit samples of 0 or 255
+void sdither(const image& img, image8& out){
+    stochastic(img, out, uint8_t(255));
 }
 
-double find_closest_palette_color(double color, int colordepth){
-    double step = 1.0 / double(colordepth - 1);
-    double palette_color = 0.0;
-    while(palette_color < color){
-        palette_color += step;
-    }
-    //if (ABS(color - palette_color) > ABS(color - (palette_color - step))){
-    //    palette_color -= step;
-    //}
-    return MIN(palette_color, 1.0f);
+//Float samples of 0 or 1. <out> may be <img> itself.
+void sdither(const image& img, image& out){
+    stochastic(img, out, 1.0f);
 }
 
-//floyd-steinberg dither
-void dither(image& img, int colordepth){
-    pixel oldpixel;
-    pixel newpixel;
-    double q_error;
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            oldpixel = img[i][j];
-            newpixel = pixel(find_closest_palette_color(oldpixel.y, colordepth));
-            img[i][j] = newpixel;
-            q_error = oldpixel.y - newpixel.y;
-            if (j < img.c() - 1)            img[i  ][j+1].y += q_error * 7.0 / 16.0;
-            if (j > 0 && i < img.r() - 1)   img[i+1][j-1].y += q_error * 3.0 / 16.0;
-            if (i < img.r() - 1)            img[i+1][j  ].y += q_error * 5.0 / 16.0;
-            if (i<img.r()-1 && j<img.c()-1) img[i+1][j+1].y += q_error * 1.0 / 16.0;
-        }
-    }
-    img.set_format("P2");
+image8 sdither(const image& img){
+    image8 out;
+    sdither(img, out);
+    return out;
 }
 
-void to_ascii(const image& original){
-    std::cout << '\n';
-    //std::string pix = " .'`^\",:;Il!i><~+_-?][}{1)(|\\/tfjrxnuvczXYUJCLQ0OZmwqpdbkhao*#MW&8%B@$";
-    std::string pix = " .:-=+*#%@";
-    int colordepth = pix.length();
-    image img = original;
-    // get terminal size
-    struct winsize size;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
-    // each ASCII character is repeated twice
-    while(img.c() > size.ws_col / 2){
-        downscale(img);
-    }
-    dither(img, colordepth);
-    double avg, count;
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            char c = pix[int(round(img[i][j].y*colordepth))];
-            std::cout << c << c;
-        }
-        std::cout << '\n';
-    }
+//floyd-steinberg dither to 1 bit
+void dither(image& img){
+    diffuse(img, floyd_steinberg(), gray_palette(2));
+    img.set_format("P1");
 }
-void to_braille(image img){
-    //unicode 8-dot braille starts at codepoint U+2800,
-    //and the dots are arranged as follows:
-    // 0 3
-    // 1 4
-    // 2 5
-    // 6 7
 
-    // get terminal size
-    struct winsize size;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &size);
-    // each braille character has a width of 2 pixels
-    while(img.c() > size.ws_col * 2){
-        downscale(img);
-    }
-    dither(img); //get the image to 1-bit b&w
-    int codepoint = 0;
-    for(int row = 0; row + 4 <= img.r(); row += 4){
-        for(int col = 0; col + 2 <= img.c(); col += 2){
-            codepoint = 0;
-            codepoint |= int(img[row+0][col+0].y);
-            codepoint |= int(img[row+1][col+0].y) << 1;
-            codepoint |= int(img[row+2][col+0].y) << 2;
-            codepoint |= int(img[row+0][col+1].y) << 3;
-            codepoint |= int(img[row+1][col+1].y) << 4;
-            codepoint |= int(img[row+2][col+1].y) << 5;
-            codepoint |= int(img[row+3][col+0].y) << 6;
-            codepoint |= int(img[row+3][col+1].y) << 7;
-            int_to_utf8(codepoint + 0x2800);
-        }
-        putchar('\n');
-    }
-    putchar('\n');
+//floyd-steinberg dither to <colordepth> gray levels. Values are rounded up to the next level.
+void dither(image& img, int colordepth){
+    diffuse(img, floyd_steinberg(), gray_palette(colordepth, true));
+    img.set_format("P2");
 }
 
+//dither with any kernel and palette
+void dither(image& img, const diffusion_kernel& k, const palette& p){
+    diffuse(img, k, p);
+    img.set_format(p.color() ? "P3" : (p.levels == 2 ? "P1" : "P2"));
+}
 
-void pixelsort(image& img, const image& edge){
-    int offset = 0;
-    int count = 0;
-    int prevpx = 0; //Default to the previous pixel not being an edge
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            //if we change from black to white or vice versa
-            if(edge[i][j].y != prevpx || j == img.c() - 1){
-                count++;
-            //}
-            //if(count %2){
-                std::sort(begin(img[i]) + offset, begin(img[i]) + j,
-                    [](const pixel& a, const pixel& b){
-                        return a.y < b.y;
-                    }
-                );
-                offset = j;
-                prevpx = edge[i][j].y;
+//Move every pixel to a random spot up to <radius> pixels away in each direction. Each output pixel
+//picks its source from the counter-based generator, keyed on its own position, so pixels are
+//independent of each other and of the thread count. Sources outside the image are clamped to the
+//edge. <out> takes the size, colour and format of <src>.
+void jitter(const image& src, image& out, int radius){
+    TRACE("jitter");
+    out.reshape(src.r(), src.c(), src.color());
+    out.set_format(src.get_format());
+    out.set_maxval(src.get_maxval());
+    const uint64_t seed = get_seed();
+    radius = MAX(radius, 0);
+    const uint32_t span = 2 * radius + 1;
+    const int planes = src.color() ? 4 : 1;
+    parallel_rows(src.r(), [&](int first, int last){
+        for(int i = first; i < last; i++){
+            for(int j = 0; j < src.c(); j++){
+                uint64_t r = random_at(seed, i, j);
+                int x = j + int(uint32_t(r) % span) - radius;
+                int y = i + int(uint32_t(r >> 32) % span) - radius;
+                clamp(x, 0, src.c() - 1);
+                clamp(y, 0, src.r() - 1);
+                for(int p = 0; p < planes; p++){
+                    const plane<float>& from = p ? src.channel(p - 1) : src.y();
+                    plane<float>& to = p ? out.channel(p - 1) : out.y();
+                    to[i][j] = from[y][x];
+                }
             }
         }
-        offset = 0;
-        prevpx = 0;
-    }
+    });
 }
 
+//In place, through a copy of the image.
 void jitter(image& img, int radius){
-    srand(time(NULL));
-    int xoff, yoff;
-    pixel temp;
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            xoff = rand() % radius - ceil(double(radius) / 2.0);
-            yoff = rand() % radius - ceil(double(radius) / 2.0);
-            clamp(xoff, 0, img.c());
-            clamp(yoff, 0, img.r());
-            temp = img[i][j];
-            img[i][j] = img[yoff][xoff];
-            img[yoff][xoff] = temp;
-        }
-    }
+    if(radius <= 0) return;
+    const image src = img;
+    jitter(src, img, radius);
 }
@@ -1,11 +1,18 @@
 #pragma once
 
-class image;
+#include <cstdint>
+
+template<typename T> class basic_image;
+typedef basic_image<float> image;
+typedef basic_image<uint8_t> image8;
+struct diffusion_kernel;
+struct palette;
 
 void dither(image&);
 void dither(image&, int);
-image sdither(const image&);
-void to_ascii(const image &);
-void to_braille(image);
-void pixelsort(image&, const image&);
+void dither(image&, const diffusion_kernel&, const palette&);
+image8 sdither(const image&);
+void sdither(const image&, image8& out);
+void sdither(const image&, image& out);
 void jitter(image&, int);
+void jitter(const image& src, image& out, int);
@@ -1,42 +1,225 @@
 #pragma once
 
-#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
 #include <string>
+#include <type_traits>
+#include <utility>
 
-struct pixel{
-    bool gray;
-    double r, g, b;
-    double y;
-    pixel(double red, double grn, double blu):
-        r(red), g(grn), b(blu)
-        {
-            gray = false;
-            //RGB to Luma realtion per ITU BT.601
-            //https://stackoverflow.com/a/596241
-            y = (0.299 * r) + (0.587 * g) + (0.114 * b);
-        }
-    pixel(double luma): y(luma), gray(true) {
-        r = y;
-        g = y;
-        b = y;
+#include "trace.hpp"
+
+//Every row of a plane starts on a boundary of this many bytes so that rows can be streamed with
+//aligned vector loads and never share a cache line with their neighbour.
+#define ROW_ALIGN 64
+
+//---------------------------------------------[Views]----------------------------------------------
+
+//Non-owning window into a plane. Cheap to copy; rows are <stride> elements apart.
+template<typename T>
+class view{
+    private:
+        T* base;
+        int rows, cols;
+        ptrdiff_t stride;
+    public:
+        view(): base(nullptr), rows(0), cols(0), stride(0) {}
+        view(T* b, int r, int c, ptrdiff_t s): base(b), rows(r), cols(c), stride(s) {}
+        int r() const { return rows; }
+        int c() const { return cols; }
+        ptrdiff_t step() const { return stride; }
+        T* operator[](size_t i) const { return base + i * stride; }
+        view sub(int row, int col, int nr, int nc) const {
+            return view(base + row * stride + col, nr, nc, stride);
+        }
+        operator view<const T>() const { return view<const T>(base, rows, cols, stride); }
+};
+
+//--------------------------------------------[Planes]----------------------------------------------
+
+struct aligned_free{
+    void operator()(void* p) const {
+        trace_free(p);
+        free(p);
     }
-    pixel():r(0), g(0), b(0), y(0), gray(true) {}
 };
 
-class image{
+//One channel of samples held in a single aligned allocation. Rows are padded to ROW_ALIGN bytes,
+//so row i begins at data + i * step().
+template<typename T>
+class plane{
     private:
-        std::vector<std::vector<pixel> > data;
+        std::unique_ptr<T[], aligned_free> data;
         int rows, cols;
+        ptrdiff_t stride;
+
+        void allocate(int r, int c){
+            const size_t per_line = ROW_ALIGN / sizeof(T);
+            rows = r;
+            cols = c;
+            stride = ((c + per_line - 1) / per_line) * per_line;
+            size_t bytes = size_t(rows) * stride * sizeof(T);
+            void* p = nullptr;
+            if(bytes && posix_memalign(&p, ROW_ALIGN, bytes)) throw std::bad_alloc();
+            if(p) memset(p, 0, bytes);
+            trace_alloc(p);
+            data.reset(static_cast<T*>(p));
+        }
+    public:
+        plane(): rows(0), cols(0), stride(0) {}
+        plane(int r, int c){ allocate(r, c); }
+        plane(const plane& other){
+            allocate(other.rows, other.cols);
+            if(rows) memcpy(data.get(), other.data.get(), size_t(rows) * stride * sizeof(T));
+        }
+        plane(plane&& other): data(std::move(other.data)),
+            rows(other.rows), cols(other.cols), stride(other.stride)
+        {
+            other.rows = other.cols = 0;
+            other.stride = 0;
+        }
+        plane& operator=(plane other){
+            std::swap(data, other.data);
+            std::swap(rows, other.rows);
+            std::swap(cols, other.cols);
+            std::swap(stride, other.stride);
+            return *this;
+        }
+        //Make the plane r x c, keeping the allocation if it already has that size. Sample values are
+        //unspecified afterwards.
+        void reshape(int r, int c){
+            if(r != rows || c != cols || !data) *this = plane(r, c);
+        }
+        int r() const { return rows; }
+        int c() const { return cols; }
+        ptrdiff_t step() const { return stride; }
+        bool empty() const { return !data; }
+        T* operator[](size_t i){ return data.get() + i * stride; }
+        const T* operator[](size_t i) const { return data.get() + i * stride; }
+        view<T> sub(int row, int col, int nr, int nc){
+            return view<T>((*this)[row] + col, nr, nc, stride);
+        }
+        view<const T> sub(int row, int col, int nr, int nc) const {
+            return view<const T>((*this)[row] + col, nr, nc, stride);
+        }
+        view<T> all(){ return sub(0, 0, rows, cols); }
+        view<const T> all() const { return sub(0, 0, rows, cols); }
+        void fill(T val){
+            for(int i = 0; i < rows; i++){
+                T* row = (*this)[i];
+                for(int j = 0; j < cols; j++) row[j] = val;
+            }
+        }
+};
+
+//-------------------------------------------[Bit Planes]-------------------------------------------
+
+//One bit per sample, 64 to a word, bit j & 63 of word j >> 6 holding column j. Rows start on a
+//ROW_ALIGN boundary like those of any other plane. For masks and 1-bit images.
+class bit_plane{
+    private:
+        plane<uint64_t> words;
+        int cols;
+    public:
+        bit_plane(): cols(0) {}
+        bit_plane(int r, int c): words(r, (c + 63) / 64), cols(c) {}
+        void reshape(int r, int c){
+            words.reshape(r, (c + 63) / 64);
+            cols = c;
+        }
+        int r() const { return words.r(); }
+        int c() const { return cols; }
+        int row_words() const { return words.c(); }
+        uint64_t* operator[](size_t i){ return words[i]; }
+        const uint64_t* operator[](size_t i) const { return words[i]; }
+        bool get(int i, int j) const { return (words[i][j >> 6] >> (j & 63)) & 1; }
+};
+
+//---------------------------------------------[Image]----------------------------------------------
+
+//Planar image with samples of type T. Luma is always present and is what every effect reads; the
+//red, green and blue planes only exist for colour images and are carried along by the effects that
+//move pixels around. Float samples are nominally in [0, 1]; integer samples run from 0 to maxval.
+//
+//Effects work on float images. The narrow types hold results that only take a few values, such as
+//edges and 1-bit dithers, at a quarter of the size or less.
+template<typename T>
+class basic_image{
+    private:
+        plane<T> luma;
+        plane<T> rgb[3];
         std::string format;
+        int maxval;
     public:
-        image();
-        image(int r, int c);
-        image(std::vector<std::vector<pixel> >);
-        image(const image&);
-        int c() const;
-        int r() const;
-        std::string get_format() const;
-        void set_format(std::string);
-        const std::vector<pixel>& operator[](size_t i) const;
-        std::vector<pixel>& operator[](size_t i);
+        basic_image(): maxval(255) {}
+        basic_image(int r, int c, bool color = false): luma(r, c), maxval(255) {
+            set_color(color);
+        }
+        int c() const { return luma.c(); }
+        int r() const { return luma.r(); }
+        bool color() const { return !rgb[0].empty(); }
+
+        //Adding colour seeds each channel from luma; removing it frees the three colour planes.
+        void set_color(bool on){
+            if(on == color()) return;
+            for(int k = 0; k < 3; k++){
+                rgb[k] = on ? luma : plane<T>();
+            }
+        }
+
+        //Make the image r x c, keeping the current planes when their size already matches so that
+        //buffers can be reused from one image to the next. Sample values are unspecified afterwards.
+        void reshape(int r, int c, bool color){
+            if(r != luma.r() || c != luma.c()){
+                luma = plane<T>(r, c);
+                for(int k = 0; k < 3; k++) rgb[k] = plane<T>();
+            }
+            for(int k = 0; k < 3; k++){
+                if(color && rgb[k].empty()) rgb[k] = plane<T>(r, c);
+                if(!color) rgb[k] = plane<T>();
+            }
+        }
+
+        //RGB to Luma realtion per ITU BT.601
+        //https://stackoverflow.com/a/596241
+        void update_luma(){
+            update_luma(0, r());
+        }
+
+        //Only rows [first, last), for passes that finish the image a band at a time.
+        void update_luma(int first, int last){
+            if(!color()) return;
+            for(int i = first; i < last; i++){
+                const T* red = rgb[0][i];
+                const T* grn = rgb[1][i];
+                const T* blu = rgb[2][i];
+                T* y = luma[i];
+                for(int j = 0; j < c(); j++){
+                    float v = (0.299f * red[j]) + (0.587f * grn[j]) + (0.114f * blu[j]);
+                    y[j] = std::is_floating_point<T>::value ? T(v) : T(v + 0.5f);
+                }
+            }
+        }
+
+        std::string get_format() const { return format; }
+        void set_format(std::string f){ format = f; }
+
+        //The largest sample value used when the image is written out. Float samples are still
+        //stored in [0, 1].
+        int get_maxval() const { return maxval; }
+        void set_maxval(int m){ maxval = m; }
+
+        plane<T>& y(){ return luma; }
+        const plane<T>& y() const { return luma; }
+        plane<T>& channel(int k){ return rgb[k]; }
+        const plane<T>& channel(int k) const { return rgb[k]; }
+        const T* operator[](size_t i) const { return luma[i]; }
+        T* operator[](size_t i){ return luma[i]; }
 };
+
+typedef basic_image<float> image;
+typedef basic_image<uint8_t> image8;
+typedef basic_image<uint16_t> image16;
@@ -3,8 +3,11 @@
 #include <math.h>
 
 #include "canny.hpp"
+#include "convolve.hpp"
 #include "imgutils.hpp"
 #include "image.hpp"
+#include "threads.hpp"
+#include "trace.hpp"
 
 //--------------------------------------[Image manipulations]---------------------------------------
 
@@ -13,72 +16,144 @@ void clamp(int& val, int min, int max){
     val = MIN(val, max);
 }
 
+//Run a 1-D pass with the tap count baked in for the common odd kernel sizes.
+#define DISPATCH_1D(PASS, N, ...) \
+    switch(N){ \
+        case 1: PASS<1>(__VA_ARGS__); break; \
+        case 3: PASS<3>(__VA_ARGS__); break; \
+        case 5: PASS<5>(__VA_ARGS__); break; \
+        case 7: PASS<7>(__VA_ARGS__); break; \
+        default: PASS<0>(__VA_ARGS__); break; \
+    }
+
+//A kernel is separable if it is the outer product of a column and a row (every 2x2 minor vanishes).
+//On success <col> and <row> hold the two factors.
+bool separable(const matrix& kernel, std::vector<float>& col, std::vector<float>& row){
+    const int kh = kernel.size();
+    const int kw = kernel[0].size();
+    int pr = -1, pc = -1;
+    for(int i = 0; i < kh && pr < 0; i++){
+        for(int j = 0; j < kw; j++){
+            if(kernel[i][j] != 0){
+                pr = i;
+                pc = j;
+                break;
+            }
+        }
+    }
+    if(pr < 0) return false;
+    const double pivot = kernel[pr][pc];
+    for(int i = 0; i < kh; i++){
+        for(int j = 0; j < kw; j++){
+            double expect = kernel[i][pc] * kernel[pr][j] / pivot;
+            if(ABS(kernel[i][j] - expect) > 1e-9 * ABS(pivot)) return false;
+        }
+    }
+    col.resize(kh);
+    row.resize(kw);
+    for(int i = 0; i < kh; i++) col[i] = kernel[i][pc];
+    for(int j = 0; j < kw; j++) row[j] = kernel[pr][j] / pivot;
+    return true;
+}
+
 //Convolution may produce pixels outside the range [0,1]
+//Separable kernels run as a horizontal and a vertical 1-D pass; anything else takes the 2-D path.
 image convolution(const image& img, const matrix& kernel, double coef){
     image out(img.r(), img.c());
-    double acc = 0;
-    int k_off = (kernel.size() - 1) / 2;
-    for(int row = 0; row < img.r(); row++){
-        for(int col = 0; col < img.c(); col++){
-            acc = 0;
-            for(int i = 0; i < kernel.size(); i++){
-                for(int j = 0; j < kernel[0].size(); j++){
-                    int r = row + i - k_off;
-                    int c = col + j - k_off;
-                    clamp(c, 0, img.c() - 1); //Extend the edge pixels to infinity
-                    clamp(r, 0, img.r() - 1);
-                    acc += kernel[i][j] * img[r][c].y;
-                }
-            }
-            acc *= coef;
-            out[row][col] = pixel(acc);
+    const int kh = kernel.size();
+    const int kw = kernel[0].size();
+    std::vector<float> col, row;
+    if(separable(kernel, col, row)){
+        for(float& k : col) k *= coef;
+        if(kw == 1){
+            parallel_rows(img.r(), [&](int first, int last){
+                DISPATCH_1D(convolve_v, kh, img.y().all(), out.y().all(), col.data(), kh, first, last);
+            });
+        }
+        else if(kh == 1){
+            //<row> is divided by the pivot, which <col> holds on its own
+            for(float& k : row) k *= col[0];
+            parallel_rows(img.r(), [&](int first, int last){
+                DISPATCH_1D(convolve_h, kw, img.y().all(), out.y().all(), row.data(), kw, first, last);
+            });
+        }
+        else if(kh == kw && kh == 3){
+            convolve_separable<3, 3>(img.y(), out.y(), row.data(), col.data());
         }
+        else if(kh == kw && kh == 5){
+            convolve_separable<5, 5>(img.y(), out.y(), row.data(), col.data());
+        }
+        else{
+            convolve_separable<0, 0>(img.y(), out.y(), row.data(), col.data(), kw, kh);
+        }
+        return out;
+    }
+    std::vector<float> k;
+    for(int i = 0; i < kh; i++){
+        for(int j = 0; j < kw; j++) k.push_back(kernel[i][j] * coef);
     }
+    parallel_rows(img.r(), [&](int first, int last){
+        if(kh == 3 && kw == 3) convolve_2d<3, 3>(img.y().all(), out.y().all(), k.data(), kh, kw, first, last);
+        else if(kh == 5 && kw == 5) convolve_2d<5, 5>(img.y().all(), out.y().all(), k.data(), kh, kw, first, last);
+        else convolve_2d<0, 0>(img.y().all(), out.y().all(), k.data(), kh, kw, first, last);
+    });
     return out;
 }
 
 //clips pixels < 0 to 0 and pixels > 1 to 1.
 void clip(image& img){
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            img[i][j].y = MAX(0.0, img[i][j].y);
-            img[i][j].y = MIN(img[i][j].y, 1.0);
+    parallel_rows(img.r(), [&](int first, int last){
+        for(int i = first; i < last; i++){
+            float* row = img[i];
+            for(int j = 0; j < img.c(); j++){
+                row[j] = MAX(0.0f, row[j]);
+                row[j] = MIN(row[j], 1.0f);
+            }
         }
-    }
+    });
 }
 
 //linear map of pixel values from range [a, b] to [0, 1]
 void remap(image& img, double a, double b){
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            img[i][j].y = (img[i][j].y - a) * (1.0 / (b - a));
+    const float scale = 1.0 / (b - a);
+    parallel_rows(img.r(), [&](int first, int last){
+        for(int i = first; i < last; i++){
+            float* row = img[i];
+            for(int j = 0; j < img.c(); j++){
+                row[j] = (row[j] - float(a)) * scale;
+            }
         }
-    }
+    });
+}
+
+//5x5 gaussian, applied as two 1-D passes. The equivalent integer kernel is
+//{2,4,5,4,2},{4,9,12,9,4},{5,12,15,12,5},{4,9,12,9,4},{2,4,5,4,2} / 159.
+static const float gaussian_kernel[5] = {0.0545, 0.2442, 0.4026, 0.2442, 0.0545};
+
+void gaussian(const image& img, image& out){
+    TRACE("gaussian");
+    out.reshape(img.r(), img.c(), false);
+    convolve_separable<5, 5>(img.y(), out.y(), gaussian_kernel, gaussian_kernel);
 }
 
 image gaussian(const image& img){
-    matrix kernel = {{2, 4,  5,  4,  2},
-                     {4, 9,  12, 9,  4},
-                     {5, 12, 15, 12, 5},
-                     {4, 9,  12, 9,  4},
-                     {2, 4,  5,  4,  2}};
-    matrix kx = {{0.0545, 0.2442, 0.4026, 0.2442, 0.0545}};
-    matrix ky = {{0.0545},
-                 {0.2442},
-                 {0.4026},
-                 {0.2442},
-                 {0.0545}};
-    return convolution(convolution(img, kx), ky);
-    //return convolution(img, kernel, 1.0/159.0);
+    image out;
+    gaussian(img, out);
+    return out;
 }
 
 image magnitude(const image& mx, const image& my){
     image out(mx.r(), mx.c());
-    for(int i = 0; i < mx.r(); i++){
-        for(int j = 0; j < mx.c(); j++){
-            out[i][j] = pixel(sqrt((mx[i][j].y * mx[i][j].y) + (my[i][j].y * my[i][j].y)));
+    parallel_rows(mx.r(), [&](int first, int last){
+        for(int i = first; i < last; i++){
+            const float* x = mx[i];
+            const float* y = my[i];
+            float* dst = out[i];
+            for(int j = 0; j < mx.c(); j++){
+                dst[j] = sqrtf((x[j] * x[j]) + (y[j] * y[j]));
+            }
         }
-    }
+    });
     return out;
 }
 
@@ -90,81 +165,179 @@ int roundangle(int theta){
     return 0;
 }
 
-matrix angle(const image& mx, const image& my){
-    matrix out;
-    out.resize(mx.r());
-    for(int i = 0; i < mx.r(); i++){
-        out[i].resize(mx.c());
-    }
-    for(int i = 0; i < mx.r(); i++){
-        for(int j = 0; j < mx.c(); j++){
-            out[i][j] = roundangle(360 * (atan2(my[i][j].y, mx[i][j].y) / (2*PI)));
+plane<float> angle(const image& mx, const image& my){
+    plane<float> out(mx.r(), mx.c());
+    parallel_rows(mx.r(), [&](int first, int last){
+        for(int i = first; i < last; i++){
+            const float* x = mx[i];
+            const float* y = my[i];
+            float* dst = out[i];
+            for(int j = 0; j < mx.c(); j++){
+                dst[j] = roundangle(360 * (atan2(y[j], x[j]) / (2*PI)));
+            }
         }
-    }
+    });
     return out;
 }
 
 //simple threshold
 void threshold(image& img, double val){
-    for(int i = 0; i < img.r(); i++){
-        for(int j = 0; j < img.c(); j++){
-            if(img[i][j].y >= val) img[i][j] = pixel(1.0);
-            else img[i][j] = pixel(0);
+    parallel_rows(img.r(), [&](int first, int last){
+        for(int i = first; i < last; i++){
+            float* row = img[i];
+            for(int j = 0; j < img.c(); j++){
+                row[j] = row[j] >= val ? 1.0f : 0.0f;
+            }
         }
-    }
+    });
 }
 
-void downscale(image& img){
-    image temp(img.r()/2, img.c()/2);
-    double r, g, b;
-    for(int row = 0; row + 2 <= img.r(); row += 2){
-        for(int col = 0; col + 2 <= img.c(); col += 2){
-            r = 0; g = 0; b = 0;
-            for(int i = 0; i < 2; i++){
-                for(int j = 0; j < 2; j++){
-                    r += img[row+i][col+j].r;
-                    g += img[row+i][col+j].g;
-                    b += img[row+i][col+j].b;
-                }
-            }
-            r /= 4; g /= 4; b /= 4;
-            temp[row/2][col/2] = pixel(r, g, b);
+//---------------------------------------[Recursive Gaussian]---------------------------------------
+
+//Above this sigma a gaussian is applied recursively, whose cost does not depend on the radius. Below
+//it the sampled kernel is short enough that convolving with it is faster and more accurate.
+#define IIR_SIGMA 1.5
+//Columns filtered together by one vertical recursive pass.
+#define IIR_BAND 128
+
+//Young and van Vliet's third-order recursive gaussian. Each axis is filtered by a causal pass
+//w[n] = b x[n] + a1 w[n-1] + a2 w[n-2] + a3 w[n-3] and then the same filter run backwards over w.
+//The causal pass starts from a constant extension of the first sample, and the backward pass from
+//Triggs and Sdika's exact values for a constant extension of the last one, so edges are extended
+//to infinity as in the convolution engine. The state is kept in double precision, since with large
+//sigma the poles come close enough to 1 that float feedback drifts visibly.
+struct recursive_gaussian{
+    double b, a1, a2, a3;
+    double m[9];                    //maps the last three causal outputs to the first backward ones
+
+    recursive_gaussian(double sigma){
+        const double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+                                      : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+        const double q2 = q * q, q3 = q2 * q;
+        const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+        a1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+        a2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+        a3 = 0.422205 * q3 / b0;
+        b = 1 - (a1 + a2 + a3);
+        const double s = b / ((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3) * (1 + a2 + (a1 - a3) * a3));
+        const double init[9] = {
+            -a3 * a1 + 1 - a3 * a3 - a2, (a3 + a1) * (a2 + a3 * a1), a3 * (a1 + a3 * a2),
+            a1 + a3 * a2, -(a2 - 1) * (a2 + a3 * a1), -a3 * (a3 * a1 + a3 * a3 + a2 - 1),
+            a3 * a1 + a2 + a1 * a1 - a2 * a2, a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3,
+            a3 * (a1 + a3 * a2)
+        };
+        for(int k = 0; k < 9; k++) m[k] = s * init[k];
+    }
+
+    //The backward outputs at n-1, n and n+1 for a line of n samples whose last input is <last> and
+    //whose causal pass ended with w[n-1], w[n-2], w[n-3].
+    void tail(double last, double w1, double w2, double w3, double out[3]) const {
+        const double d1 = w1 - last, d2 = w2 - last, d3 = w3 - last;
+        for(int k = 0; k < 3; k++) out[k] = m[3 * k] * d1 + m[3 * k + 1] * d2 + m[3 * k + 2] * d3 + last;
+    }
+};
+
+//Vertical recursive pass over columns [c0, c1) of <img>, in place. Rather than walking down one
+//column at a time, every step updates a whole row of the band from the three rows before it, so the
+//reads are contiguous and the recursion vectorizes across columns.
+static void iir_columns(view<float> img, const recursive_gaussian& g, int c0, int c1){
+    const int n = c1 - c0;
+    const int h = img.r();
+    double p1[IIR_BAND], p2[IIR_BAND], p3[IIR_BAND], last[IIR_BAND];
+    const float* first = img[0] + c0;
+    const float* bottom = img[h - 1] + c0;
+    for(int j = 0; j < n; j++){
+        p1[j] = p2[j] = p3[j] = first[j];
+        last[j] = bottom[j];
+    }
+    for(int i = 0; i < h; i++){
+        float* row = img[i] + c0;
+        for(int j = 0; j < n; j++){
+            const double v = g.b * row[j] + g.a1 * p1[j] + g.a2 * p2[j] + g.a3 * p3[j];
+            row[j] = v;
+            p3[j] = p2[j];
+            p2[j] = p1[j];
+            p1[j] = v;
+        }
+    }
+    float* w1 = img[h - 1] + c0;
+    const float* w2 = img[h - 2] + c0;
+    const float* w3 = img[h - 3] + c0;
+    for(int j = 0; j < n; j++){
+        double t[3];
+        g.tail(last[j], w1[j], w2[j], w3[j], t);
+        w1[j] = t[0];
+        p1[j] = t[0];
+        p2[j] = t[1];
+        p3[j] = t[2];
+    }
+    for(int i = h - 2; i >= 0; i--){
+        float* row = img[i] + c0;
+        for(int j = 0; j < n; j++){
+            const double v = g.b * row[j] + g.a1 * p1[j] + g.a2 * p2[j] + g.a3 * p3[j];
+            row[j] = v;
+            p3[j] = p2[j];
+            p2[j] = p1[j];
+            p1[j] = v;
         }
     }
-    img = temp;
 }
 
-int int_to_utf8(uint32_t val){
-    int width = 0; //The width of the output character in bytes.
-    if (val < 0x80){
-        //trivial case - this is just ASCII. We're done.
-        putchar(val);
-        return 0;
+//Horizontal recursive pass over rows [r0, r1). A recursion along a row is one long chain of
+//dependent multiplies, so the rows are instead transposed IIR_BAND at a time into a buffer of the
+//thread, filtered there by the vertical pass, and transposed back.
+static void iir_rows(view<const float> src, view<float> dst, const recursive_gaussian& g, int r0, int r1){
+    static thread_local plane<float> temp;
+    temp.reshape(src.c(), IIR_BAND);
+    for(int i = r0; i < r1; i += IIR_BAND){
+        const int n = MIN(IIR_BAND, r1 - i);
+        for(int j = 0; j < src.c(); j++){
+            float* t = temp[j];
+            for(int k = 0; k < n; k++) t[k] = src[i + k][j];
+        }
+        iir_columns(temp.all(), g, 0, n);
+        for(int k = 0; k < n; k++){
+            float* out = dst[i + k];
+            for(int j = 0; j < src.c(); j++) out[j] = temp[j][k];
+        }
     }
-    else if (val < 0x00000800)  width = 2;
-    else if (val < 0x00010000)  width = 3;
-    else if (val < 0x00200000)  width = 4;
-    else if (val < 0x04000000)  width = 5;
-    else if (val < 0x80000000)  width = 6;
-    else{
-        fprintf(stderr, "Illegal codepoint.\n");
-        return 1;
+}
+
+//Gaussian of standard deviation <sigma> from <src> into <dst>, which must already have its size.
+//Small sigma is convolved with the kernel sampled out to three deviations; larger sigma, on planes
+//long enough for the recursive filter to start, is filtered recursively.
+static void gaussian_plane(const plane<float>& src, plane<float>& dst, double sigma){
+    if(sigma <= IIR_SIGMA || src.r() < 4 || src.c() < 4){
+        const int radius = ceil(3 * sigma);
+        std::vector<float> k(2 * radius + 1);
+        double sum = 0;
+        for(int t = -radius; t <= radius; t++) sum += k[t + radius] = exp(-t * t / (2 * sigma * sigma));
+        for(float& v : k) v /= sum;
+        convolve_separable<0, 0>(src, dst, k.data(), k.data(), k.size(), k.size());
+        return;
     }
+    const recursive_gaussian g(sigma);
+    parallel_rows(src.r(), [&](int first, int last){
+        iir_rows(src.all(), dst.all(), g, first, last);
+    });
+    parallel_for((src.c() + IIR_BAND - 1) / IIR_BAND, [&](int band){
+        const int c0 = band * IIR_BAND;
+        iir_columns(dst.all(), g, c0, MIN(c0 + IIR_BAND, src.c()));
+    });
+}
 
-    uint8_t firstbits = 7 - width;
-    uint8_t totalbits = firstbits + (width - 1) * 6;
-    //This bitwise hacking produces a byte with a number of leading 1s equal to the value <width>.
-    //For example, if width == 5, then msb_mask will be 0b11111000.
-    uint8_t msb_mask = ~((1 << (firstbits + 1)) - 1);
-
-    //The first byte is the leading 1s defined by msb_mask followed by the first few bits of <val>.
-    putchar(msb_mask | (val >> (totalbits - firstbits)));
-    //The remaining bytes are prefixed with 0b10 and contain 6 bits of data.
-    char byte;
-    for (int i = width - 2; i >= 0; i--){
-        byte = 0x3f & (val >> 6 * i); //0x3f isolates the six least significant bits
-        byte |= 0x80;
-        putchar(byte);
+//The same gaussian over every plane the image carries. <out> takes the colour and format of <img>.
+//With <sigma> of 0 it is the fixed 5x5 kernel of gaussian(), and otherwise a gaussian of that deviation.
+void blur(const image& img, image& out, double sigma){
+    TRACE("blur");
+    out.reshape(img.r(), img.c(), img.color());
+    out.set_format(img.get_format());
+    out.set_maxval(img.get_maxval());
+    const float* k = gaussian_kernel;
+    for(int p = -1; p < (img.color() ? 3 : 0); p++){
+        const plane<float>& src = p < 0 ? img.y() : img.channel(p);
+        plane<float>& dst = p < 0 ? out.y() : out.channel(p);
+        if(sigma > 0) gaussian_plane(src, dst, sigma);
+        else convolve_separable<5, 5>(src, dst, k, k);
     }
-    return 0;
 }
@@ -20,18 +20,20 @@ struct coord{
 
 typedef std::vector<std::vector<double> > matrix;
 
-class image;
+template<typename T> class basic_image;
+typedef basic_image<float> image;
+template<typename T> class plane;
 
 //-------------------------------------------[Functions]--------------------------------------------
 
 image convolution(const image&, const matrix& kernel, double coef = 1.0);
 image gaussian(const image&);
+void gaussian(const image&, image& out);
+void blur(const image&, image& out, double sigma = 0);
 image magnitude(const image& x, const image& y);
 image newimage();
-void downscale(image&);
-matrix angle(const image& x, const image& y);
+plane<float> angle(const image& x, const image& y);
 void threshold(image&, double value);
 void clip(image&);
 void clamp(int&, int, int);
-int int_to_utf8(uint32_t);
 void remap(image&, double, double);
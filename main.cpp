@@ -1,24 +1,66 @@
 #include <cmath>        //ceil
-#include <cstdlib>      //rand
-#include <ctime>
+#include <cstdlib>
 #include <iostream>
+#include <fcntl.h>
+#include <getopt.h>
 #include <unistd.h>
 
 #include "imgutils.hpp"
+#include "cache.hpp"
 #include "canny.hpp"
 #include "image.hpp"
 #include "ppm.hpp"
+#include "diffusion.hpp"
 #include "effects.hpp"
+#include "modes.hpp"
+#include "rng.hpp"
+#include "terminal.hpp"
+#include "threads.hpp"
+#include "tiles.hpp"
+#include "trace.hpp"
 
 //-----------------------------------------[Pixel Sorting]------------------------------------------
 
+//Write to the file given with -o, or to stdout.
+int output(const result& res, const std::string& fname, bool raw){
+    return fname.empty() ? res.write(STDOUT_FILENO, raw) : res.save(fname, raw);
+}
+
+//Options without a short form
+enum { OPT_SEED = 512, OPT_TRACE, OPT_STATS, OPT_MAX_MEMORY, OPT_CACHE, OPT_CACHE_SIZE };
+
+static const struct option long_options[] = {
+    {"help",    no_argument,       nullptr, 'h'},
+    {"seed",    required_argument, nullptr, OPT_SEED},
+    {"trace",   required_argument, nullptr, OPT_TRACE},
+    {"stats",   no_argument,       nullptr, OPT_STATS},
+    {"max-memory", required_argument, nullptr, OPT_MAX_MEMORY},
+    {"cache",   required_argument, nullptr, OPT_CACHE},
+    {"cache-size", required_argument, nullptr, OPT_CACHE_SIZE},
+    {"jitter",  required_argument, nullptr, FLAG_JITTER},
+    {"sdither", no_argument,       nullptr, FLAG_SDITHER},
+    {"chain",   required_argument, nullptr, FLAG_CHAIN},
+    {nullptr, 0, nullptr, 0}
+};
+
 int main(int argc, char* argv[]){
     opterr = 0;     // don't print error messages
-    int c, flag;
-    bool has_image = false;
+    int c, flag = 0;
+    int radius = 0;
+    bool raw = false;
+    bool frames = false;
+    bool color = false;
+    bool stats = false;
+    size_t max_memory = 0;
+    size_t cache_size = size_t(1) << 30;
+    resample_filter filter = BOX;
+    sort_options sort;
+    std::vector<chain_stage> chain;
+    std::string infile, outfile, tracefile, cachedir;
+    const diffusion_kernel* kernel = &floyd_steinberg();
+    palette pal = gray_palette(4, true);
     image img;
-    srand(time(NULL));
-    while ((c = getopt(argc, argv, "abdehi:s")) != -1) {
+    while ((c = getopt_long(argc, argv, "abcdefhi:j:k:m:o:p:rst:y:", long_options, nullptr)) != -1) {
         switch (c) {
             case 'a':
                 flag = c;
@@ -26,31 +68,151 @@ int main(int argc, char* argv[]){
             case 'b':
                 flag = c;
                 break;
+            case 'c':
+                color = true;
+                break;
             case 'd':
                 flag = c;
                 break;
             case 'e':
                 flag = c;
                 break;
+            case 'f':
+                frames = true;
+                break;
             case 'h':
-                std::cout << "Options:\n"
+                std::cout << "Usage: glitch [options] [file or directory]...\n"
+                          << "Files and directories given after the options are processed as a batch into the directory\n"
+                          << "named by -o, with an effect that produces an image (-d, -e, -s, --jitter, --sdither,\n"
+                          << "--chain).\n\n"
+                          << "Options:\n"
                           << "\t-a\tPrint an ASCII representation of the image.\n"
-                          << "\t-d\tPrint 1-bit dithered image to stdout\n"
+                          << "\t-b\tPrint the image in braille characters.\n"
+                          << "\t-c\tColour the output of -a and -b with 24-bit ANSI escapes.\n"
+                          << "\t-d\tPrint a dithered image to stdout (4 gray levels unless -p is given).\n"
                           << "\t-e\tEdge detection and print a PPM image to stdout.\n"
+                          << "\t-f\tRead a stream of concatenated frames (e.g. ffmpeg -f image2pipe) and write\n"
+                          << "\t\tevery frame, processed by the chosen effect, back to back. With -a or -b,\n"
+                          << "\t\tframes are drawn in place and only changed characters are redrawn.\n"
                           << "\t-h\tPrint this message.\n"
-                          << "\t-i file\tInput file (PPM format only). If this option is not specified, read from stdin.\n"
-                          << "\t-s\tSort pixels and print a PPM image to stdout.\n\n"
+                          << "\t-i file\tInput file (PBM, PGM or PPM). If this option is not specified, read from stdin.\n"
+                          << "\t-j N\tUse N threads (default: one per CPU).\n"
+                          << "\t-k name\tError diffusion kernel for -d: " << kernel_names() << ".\n"
+                          << "\t-m mode\tSort direction for -s: rows (default), columns, or an angle in degrees. Rows and\n"
+                          << "\t\tcolumns may also be called horizontal and vertical.\n"
+                          << "\t-o file\tWrite the image to <file> instead of stdout. In batch mode, the output directory.\n"
+                          << "\t-p list\tDither to a palette of comma separated hex colours, e.g. #000000,#ff0000.\n"
+                          << "\t-r\tWrite binary (P4/P5/P6) output. Binary input always produces binary output.\n"
+                          << "\t-s\tSort pixels and print a PPM image to stdout.\n"
+                          << "\t-t name\tFilter used to fit -a and -b output to the terminal: box (default), bilinear, lanczos.\n"
+                          << "\t-y key\tSort key for -s: luma (default), red, green, blue, hue, saturation, value.\n"
+                          << "\t--jitter N\tMove every pixel to a random spot up to N pixels away.\n"
+                          << "\t--sdither\tStochastic dither to 1 bit.\n"
+                          << "\t--chain list\tRun several effects in turn, e.g. \"gaussian,edges,sort:vertical,jitter:4,dither:4\".\n"
+                          << "\t\tStages: gaussian[:sigma], edges, sort[:mode[:key]], jitter:N, dither[:levels], sdither,\n"
+                          << "\t\tremap:a:b, clip, threshold[:v], quantize:levels.\n"
+                          << "\t\tRuns of remap, clip, threshold and quantize are done in a single pass.\n"
+                          << "\t\tthreshold and quantize work on luma, so they turn a colour image gray.\n"
+                          << "\t\tgaussian alone is a fixed 5x5 kernel; with sigma, heavier smoothing at the same cost.\n"
+                          << "\t--seed N\tSeed for the random effects, for reproducible output (default: the clock).\n"
+                          << "\t--trace file\tRecord the time and heap use of every stage and write them to <file> as\n"
+                          << "\t\tChrome trace JSON (open with chrome://tracing or ui.perfetto.dev).\n"
+                          << "\t--stats\tPrint the time and heap use of every stage to stderr.\n"
+                          << "\t\tHeap use only counts memory allocated once tracing has started.\n"
+                          << "\t--max-memory N\tKeep memory use to about N bytes (suffix K, M or G) by working through\n"
+                          << "\t\tlarger images in strips of rows, with the same output. Works on a file given with\n"
+                          << "\t\t-i; images that do not fit must be binary and take -e, or -s along rows.\n"
+                          << "\t--cache dir\tKeep edge maps and terminal previews in <dir> and reuse them for images\n"
+                          << "\t\twith the same pixels. With --stats, the hits and misses are printed at exit.\n"
+                          << "\t--cache-size N\tDelete the least recently used entries beyond N bytes (default 1G).\n\n"
                           << "Any PPM image can either be written to a file and viewed with most "
                           << "image software, or it can be piped directly into "
                           << "ImageMagick's \033[1mdisplay\033[0m program.\n";
                 return 0;
             case 'i':
-                has_image = true;
-                img = openppm(std::string(optarg));
+                infile = optarg;
+                break;
+            case 'j':
+                set_threads(atoi(optarg));
+                break;
+            case 'k':
+                kernel = find_kernel(optarg);
+                if(!kernel){
+                    std::cerr << "Unknown kernel. Choose from " << kernel_names() << ".\n";
+                    return 1;
+                }
+                break;
+            case 'm':
+                if(!parse_sort_mode(optarg, sort.angle)){
+                    std::cerr << "Unknown sort mode. Use rows, columns or an angle in degrees.\n";
+                    return 1;
+                }
+                break;
+            case 'o':
+                outfile = optarg;
+                break;
+            case 'p':
+                if(!rgb_palette(optarg, pal)){
+                    std::cerr << "Malformed palette.\n";
+                    return 1;
+                }
+                break;
+            case 'r':
+                raw = true;
                 break;
             case 's':
                 flag = c;
                 break;
+            case 't':
+                if(!find_filter(optarg, filter)){
+                    std::cerr << "Unknown filter. Choose from box, bilinear, lanczos.\n";
+                    return 1;
+                }
+                break;
+            case 'y':
+                if(!find_sort_key(optarg, sort.key)){
+                    std::cerr << "Unknown sort key. Choose from luma, red, green, blue, hue, saturation, value.\n";
+                    return 1;
+                }
+                break;
+            case OPT_SEED:
+                set_seed(strtoull(optarg, nullptr, 0));
+                break;
+            case OPT_TRACE:
+                tracefile = optarg;
+                break;
+            case OPT_STATS:
+                stats = true;
+                break;
+            case OPT_CACHE:
+                cachedir = optarg;
+                break;
+            case OPT_CACHE_SIZE:
+                if(!parse_size(optarg, cache_size)){
+                    std::cerr << "Malformed cache size.\n";
+                    return 1;
+                }
+                break;
+            case OPT_MAX_MEMORY:
+                if(!parse_size(optarg, max_memory)){
+                    std::cerr << "Malformed memory size.\n";
+                    return 1;
+                }
+                break;
+            case FLAG_JITTER:
+                flag = c;
+                radius = atoi(optarg);
+                break;
+            case FLAG_SDITHER:
+                flag = c;
+                break;
+            case FLAG_CHAIN:
+                flag = c;
+                if(!parse_chain(optarg, chain)){
+                    std::cerr << "Malformed chain. Stages: " << chain_help() << ".\n";
+                    return 1;
+                }
+                break;
             case '?':
                 std::cerr << "Unknown option.\n";
                 return 1;
@@ -60,9 +222,48 @@ int main(int argc, char* argv[]){
         }
     }
 
-    if(!has_image) {
+    if(stats || !tracefile.empty()) start_tracing(tracefile, stats);
+    if(!cachedir.empty()) open_cache(cachedir, cache_size, stats);
+    settings opts = {flag, raw, color, filter, kernel, pal, sort, radius, chain};
+    if(frames && !flag){
+        std::cerr << "Frame mode needs an effect.\n";
+        return 1;
+    }
+    if(optind < argc && !writes_image(flag)){
+        std::cerr << "Batch mode needs an effect that produces an image.\n";
+        return 1;
+    }
+    if(max_memory){
+        if(frames || optind < argc || infile.empty() || !writes_image(flag)){
+            std::cerr << "--max-memory needs an input file (-i) and an effect that produces an image.\n";
+            return 1;
+        }
+        return tiled(infile, outfile, opts, max_memory);
+    }
+    if(frames){
+        int in = infile.empty() ? STDIN_FILENO : open(infile.c_str(), O_RDONLY);
+        int out = outfile.empty() ? STDOUT_FILENO : open(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(in < 0 || out < 0){
+            std::cerr << "Unable to open file.\n";
+            return 1;
+        }
+        return stream(in, out, opts);
+    }
+    if(optind < argc){
+        if(outfile.empty()){
+            std::cerr << "Batch mode needs an output directory (-o).\n";
+            return 1;
+        }
+        return batch(collect_inputs(std::vector<std::string>(argv + optind, argv + argc)), outfile, opts);
+    }
+
+    if(infile.empty()) {
         img = readppm(std::cin);
     }
+    else {
+        img = openppm(infile);
+    }
+    raw = binary_output(opts, img);
 
     // The reason that this is not just handled in the getopt block is so that we maintain the
     // flexibility of reading an image from stdin, or specifying it with -i, and having the program
@@ -70,18 +271,13 @@ int main(int argc, char* argv[]){
 
     switch(flag) {
         case 'a':
-            to_ascii(img);
-            return 0;
+            return terminal(STDOUT_FILENO, terminal::ASCII, color, false, filter).draw(img);
         case 'b':
-            to_braille(img);
-            return 0;
-        case 'e':
-            return printppm(canny(img));
-        case 'd':
-            dither(img, 4);
-            return printppm(img);
-        case 's':
-            pixelsort(img, canny(img));
-            return printppm(img);
+            return terminal(STDOUT_FILENO, terminal::BRAILLE, color, false, filter).draw(img);
+        default:{
+            if(!writes_image(flag)) return 0;
+            workspace space;
+            return output(apply(opts, img, space), outfile, raw);
+        }
     }
 }
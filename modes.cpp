@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "cache.hpp"
+#include "canny.hpp"
+#include "effects.hpp"
+#include "image.hpp"
+#include "imgutils.hpp"
+#include "modes.hpp"
+#include "ppm.hpp"
+#include "terminal.hpp"
+#include "threads.hpp"
+
+namespace fs = std::filesystem;
+
+//---------------------------------------------[Effects]--------------------------------------------
+
+//canny_edges() into <w.edges>, through the cache when there is one. Edges depend on luma alone, so
+//the key leaves the colour planes out.
+static void find_edges(const image& img, workspace& w){
+    if(!cache_enabled()){
+        canny_edges(img, w.canny, w.edges);
+        return;
+    }
+    const uint64_t key = cache_key(hash_image(img, false), "canny 1");
+    if(load_edges(key, img.r(), img.c(), w.edges)) return;
+    canny_edges(img, w.canny, w.edges);
+    store_edges(key, w.edges);
+}
+
+//Run the stages of a --chain in order. The stages that read a neighbourhood around each pixel
+//(gaussian, jitter) write to the spare image of the workspace, which then trades places with <img>;
+//every other stage works in place, so a chain of any length needs two images at most.
+static void run_chain(const settings& s, image& img, workspace& w){
+    for(const chain_stage& st : s.chain){
+        switch(st.kind){
+            case CHAIN_GAUSSIAN:
+                blur(img, w.spare, st.sigma);
+                std::swap(img, w.spare);
+                break;
+            case CHAIN_EDGES:
+                find_edges(img, w);
+                img.set_color(false);
+                img.set_maxval(255);
+                draw_edges(w.edges, img);
+                img.set_format("P2");
+                break;
+            case CHAIN_SORT:
+                find_edges(img, w);
+                pixelsort(img, w.edges, st.sort);
+                break;
+            case CHAIN_JITTER:
+                jitter(img, w.spare, st.radius);
+                std::swap(img, w.spare);
+                break;
+            case CHAIN_DITHER:
+                if(st.levels) dither(img, *s.kernel, gray_palette(st.levels, true));
+                else dither(img, *s.kernel, s.pal);
+                break;
+            case CHAIN_SDITHER:
+                sdither(img, img);
+                break;
+            case CHAIN_POINTWISE:
+                pointwise(img, st.ops);
+                break;
+        }
+    }
+}
+
+//Run the effect picked by <s.flag> on <img>. Effects that build a new image leave it in <w.out>;
+//the others work in place. Returns whichever of the two holds the result. The terminal renderers
+//(-a, -b) take the image as it is.
+result apply(const settings& s, image& img, workspace& w){
+    switch(s.flag){
+        case 'e':
+            find_edges(img, w);
+            edge_image(w.edges, w.out);
+            return result{nullptr, &w.out};
+        case 'd':
+            dither(img, *s.kernel, s.pal);
+            break;
+        case 's':
+            find_edges(img, w);
+            pixelsort(img, w.edges, s.sort);
+            break;
+        case FLAG_JITTER:
+            jitter(img, s.radius);
+            break;
+        case FLAG_SDITHER:
+            sdither(img, w.out);
+            return result{nullptr, &w.out};
+        case FLAG_CHAIN:
+            run_chain(s, img, w);
+            break;
+    }
+    return result{&img, nullptr};
+}
+
+std::string result::format() const {
+    return full ? full->get_format() : narrow->get_format();
+}
+
+int result::write(int fd, bool raw) const {
+    return full ? writeppm(*full, fd, raw) : writeppm(*narrow, fd, raw);
+}
+
+int result::save(const std::string& fname, bool raw) const {
+    return full ? saveppm(*full, fname, raw) : saveppm(*narrow, fname, raw);
+}
+
+//Whether <flag> picks an effect that produces an image, as opposed to terminal output.
+bool writes_image(int flag){
+    return flag == 'd' || flag == 'e' || flag == 's' || flag == FLAG_JITTER || flag == FLAG_SDITHER ||
+           flag == FLAG_CHAIN;
+}
+
+//Whether the result for <img> is written in binary: when -r asks for it, and always for binary input.
+//<img> is the image as it was read, before the effect changes its format.
+bool binary_output(const settings& s, const image& img){
+    const std::string& format = img.get_format();
+    return s.raw || format == "P4" || format == "P5" || format == "P6";
+}
+
+//-------------------------------------------[Batch Mode]-------------------------------------------
+
+static bool is_pnm(const fs::path& p){
+    std::string ext = p.extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".pbm" || ext == ".pgm" || ext == ".ppm" || ext == ".pnm";
+}
+
+//Expand directories into the PNM files they hold, sorted by name. Plain files are taken as they are.
+std::vector<std::string> collect_inputs(const std::vector<std::string>& paths){
+    std::vector<std::string> files;
+    for(const std::string& p : paths){
+        std::error_code err;
+        if(!fs::is_directory(p, err)){
+            files.push_back(p);
+            continue;
+        }
+        std::vector<std::string> found;
+        for(const fs::directory_entry& e : fs::directory_iterator(p, err)){
+            if(e.is_regular_file(err) && is_pnm(e.path())) found.push_back(e.path().string());
+        }
+        std::sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+    }
+    return files;
+}
+
+//Extension matching what writeppm() produces for <format>.
+static const char* extension(const std::string& format){
+    if(format == "P1" || format == "P4") return ".pbm";
+    if(format == "P2" || format == "P5") return ".pgm";
+    return ".ppm";
+}
+
+//Outputs are named after the stem of their input, so two inputs with the same stem, such as a/img.ppm
+//and b/img.pgm, would overwrite each other. Reports every such pair and returns false if there are any.
+static bool distinct_names(const std::vector<std::string>& inputs){
+    std::map<std::string, const std::string*> seen;
+    bool ok = true;
+    for(const std::string& in : inputs){
+        auto it = seen.emplace(fs::path(in).stem().string(), &in);
+        if(it.second) continue;
+        std::cerr << in << ": same output name as " << *it.first->second << ".\n";
+        ok = false;
+    }
+    return ok;
+}
+
+typedef std::chrono::steady_clock clock_type;
+
+static double ms_since(clock_type::time_point& t){
+    clock_type::time_point now = clock_type::now();
+    double ms = std::chrono::duration<double, std::milli>(now - t).count();
+    t = now;
+    return ms;
+}
+
+//One queue of file indices per worker. A worker takes from the front of its own queue and, once
+//that is empty, steals from the back of the others, so a run of slow files on one worker gets
+//spread out instead of holding up the end of the batch.
+class job_queue{
+    private:
+        struct lane{
+            std::mutex m;
+            std::deque<int> jobs;
+        };
+        std::vector<lane> lanes;
+    public:
+        job_queue(int workers, int jobs): lanes(workers) {
+            for(int i = 0; i < jobs; i++) lanes[i % workers].jobs.push_back(i);
+        }
+        bool take(int self, int& job){
+            for(size_t k = 0; k < lanes.size(); k++){
+                lane& l = lanes[(self + k) % lanes.size()];
+                std::lock_guard<std::mutex> lock(l.m);
+                if(l.jobs.empty()) continue;
+                if(k == 0){
+                    job = l.jobs.front();
+                    l.jobs.pop_front();
+                }
+                else{
+                    job = l.jobs.back();
+                    l.jobs.pop_back();
+                }
+                return true;
+            }
+            return false;
+        }
+};
+
+//Process every file in <inputs> and write the results into <outdir>, one image per worker thread
+//at a time. Each worker decodes into and works in the same buffers for every file it handles, so a
+//batch of equally sized frames only allocates while the first few are processed. Per-file timings go to stderr.
+//Nothing is written if two inputs would share an output name.
+int batch(const std::vector<std::string>& inputs, const std::string& outdir, const settings& s){
+    if(!distinct_names(inputs)) return 1;
+    std::error_code err;
+    fs::create_directories(outdir, err);
+    if(!fs::is_directory(outdir, err)){
+        std::cerr << "Unable to create output directory.\n";
+        return 1;
+    }
+    const int n = inputs.size();
+    const int workers = std::max(1, std::min(thread_count(), n));
+    job_queue queue(workers, n);
+    std::mutex log;
+    int failed = 0;
+    double pixels = 0;
+    clock_type::time_point start = clock_type::now();
+
+    auto work = [&](int self){
+        run_serially(true);
+        image img;
+        workspace space;
+        int job;
+        while(queue.take(self, job)){
+            clock_type::time_point t = clock_type::now();
+            if(!loadppm(inputs[job], img)){
+                std::lock_guard<std::mutex> lock(log);
+                failed++;
+                fprintf(stderr, "%s: unreadable\n", inputs[job].c_str());
+                continue;
+            }
+            bool raw = binary_output(s, img);
+            double read = ms_since(t);
+            const result out = apply(s, img, space);
+            double effect = ms_since(t);
+            fs::path dest = fs::path(outdir) / fs::path(inputs[job]).stem();
+            dest += extension(out.format());
+            int ret = out.save(dest.string(), raw);
+            double write = ms_since(t);
+
+            std::lock_guard<std::mutex> lock(log);
+            if(ret) failed++;
+            pixels += double(img.r()) * img.c();
+            fprintf(stderr, "%s: %dx%d read %.2f ms, effect %.2f ms, write %.2f ms\n",
+                    inputs[job].c_str(), img.c(), img.r(), read, effect, write);
+        }
+        run_serially(false);
+    };
+    std::vector<std::thread> threads;
+    for(int i = 1; i < workers; i++) threads.emplace_back(work, i);
+    work(0);
+    for(std::thread& t : threads) t.join();
+
+    double secs = std::chrono::duration<double>(clock_type::now() - start).count();
+    fprintf(stderr, "%d files in %.2f s (%.1f MP/s) on %d threads\n",
+            n, secs, pixels / 1e6 / std::max(secs, 1e-9), workers);
+    return failed ? 1 : 0;
+}
+
+//------------------------------------------[Frame Streams]-----------------------------------------
+
+//Frames in flight between the stages of stream().
+#define STREAM_FRAMES 4
+
+struct frame{
+    image img;
+    image8 scratch;
+    result out;
+    bool raw;
+};
+
+//Read back-to-back images from <in>, apply the effect to each one and write them to <out>. Decoding,
+//the effect and encoding run on three threads connected by bounded queues, so frame n+1 is read and
+//frame n-1 written while frame n is processed. A fixed set of frames circulates between the stages
+//and a null frame marks the end of the input. Each stage handles frames in the order they arrive, so
+//frames come out in the order they went in. With -a or -b the encoder draws every frame in place on
+//the terminal instead.
+int stream(int in, int out, const settings& s){
+    frame frames[STREAM_FRAMES];
+    bounded_queue<frame*> free_frames(STREAM_FRAMES), decoded(STREAM_FRAMES), processed(STREAM_FRAMES);
+    for(frame& f : frames) free_frames.push(&f);
+    int ret = 0;
+
+    std::thread decoder([&]{
+        frame_reader reader(in);
+        for(;;){
+            frame* f = free_frames.pop();
+            if(!reader.next(f->img)){
+                decoded.push(nullptr);
+                return;
+            }
+            f->raw = binary_output(s, f->img);
+            decoded.push(f);
+        }
+    });
+    std::thread encoder([&]{
+        const bool text = s.flag == 'a' || s.flag == 'b';
+        terminal term(out, s.flag == 'a' ? terminal::ASCII : terminal::BRAILLE, s.color, true, s.filter);
+        frame* f;
+        while((f = processed.pop())){
+            if(text) term.draw(*f->out.full);
+            else if(f->out.write(out, f->raw)) ret = 1;
+            free_frames.push(f);
+        }
+    });
+    //The effect stage keeps a single workspace. A result built in it is swapped into the frame, so
+    //the frame carries it to the encoder and brings back a buffer for a later frame.
+    workspace space;
+    frame* f;
+    while((f = decoded.pop())){
+        f->out = apply(s, f->img, space);
+        if(f->out.narrow == &space.out){
+            std::swap(space.out, f->scratch);
+            f->out.narrow = &f->scratch;
+        }
+        processed.push(f);
+    }
+    processed.push(nullptr);
+    decoder.join();
+    encoder.join();
+    return ret;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "canny.hpp"
+#include "chain.hpp"
+#include "diffusion.hpp"
+#include "image.hpp"
+#include "pixelsort.hpp"
+#include "resample.hpp"
+
+//Effects that only have a long option. Short options use their own letter as the flag.
+enum { FLAG_JITTER = 256, FLAG_SDITHER, FLAG_CHAIN };
+
+//Everything that decides what happens to an image, as given on the command line.
+struct settings{
+    int flag;
+    bool raw;
+    bool color;                     //colour terminal output for -a and -b
+    resample_filter filter;         //used to fit -a and -b output to the terminal
+    const diffusion_kernel* kernel;
+    palette pal;
+    sort_options sort;
+    int radius;                     //for --jitter
+    std::vector<chain_stage> chain; //for --chain
+};
+
+//Buffers the effects draw on, kept by the caller from one image to the next so that images of the
+//same size are processed without allocating.
+struct workspace{
+    image8 out;                     //result of the effects that build a new image (-e, --sdither)
+    image spare;                    //second image for the stages of a chain that cannot work in place
+    canny_scratch canny;
+    edge_mask edges;
+};
+
+//What apply() produced: the float image it worked on in place, or an image with 8-bit samples for the
+//effects whose output only takes a few values. Exactly one of the two is set.
+struct result{
+    const image* full;
+    const image8* narrow;
+    std::string format() const;
+    int write(int fd, bool raw) const;
+    int save(const std::string& fname, bool raw) const;
+};
+
+bool writes_image(int flag);
+bool binary_output(const settings&, const image&);
+
+result apply(const settings&, image& img, workspace&);
+std::vector<std::string> collect_inputs(const std::vector<std::string>& paths);
+int batch(const std::vector<std::string>& inputs, const std::string& outdir, const settings&);
+int stream(int in, int out, const settings&);
@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "canny.hpp"
+#include "image.hpp"
+#include "imgutils.hpp"
+#include "pixelsort.hpp"
+#include "threads.hpp"
+#include "trace.hpp"
+
+//--------------------------------------------[Sort Keys]-------------------------------------------
+
+static const char* key_names[] = {"luma", "red", "green", "blue", "hue", "saturation", "value"};
+
+bool find_sort_key(const std::string& name, sort_key& key){
+    for(int k = 0; k < int(sizeof(key_names) / sizeof(key_names[0])); k++){
+        if(name == key_names[k]){
+            key = sort_key(k);
+            return true;
+        }
+    }
+    return false;
+}
+
+//"rows", "columns", or an angle in degrees.
+bool parse_sort_mode(const std::string& mode, double& angle){
+    if(mode == "rows" || mode == "horizontal") angle = 0;
+    else if(mode == "columns" || mode == "vertical") angle = 90;
+    else{
+        char* end;
+        angle = strtod(mode.c_str(), &end);
+        if(mode.empty() || *end) return false;
+    }
+    return true;
+}
+
+//The key of one pixel as a float in [0, 1].
+static inline float key_value(sort_key key, float y, float r, float g, float b){
+    switch(key){
+        case KEY_RED:   return r;
+        case KEY_GREEN: return g;
+        case KEY_BLUE:  return b;
+        default: break;
+    }
+    const float hi = MAX(r, MAX(g, b));
+    const float lo = MIN(r, MIN(g, b));
+    const float d = hi - lo;
+    switch(key){
+        case KEY_VALUE:
+            return hi;
+        case KEY_SATURATION:
+            return hi > 0 ? d / hi : 0;
+        case KEY_HUE:{
+            if(d <= 0) return 0;
+            float h = hi == r ? (g - b) / d : (hi == g ? 2 + (b - r) / d : 4 + (r - g) / d);
+            return h < 0 ? h / 6 + 1 : h / 6;
+        }
+        default:
+            return y;
+    }
+}
+
+//Keys are quantized to 16 bits, which keeps every distinct value of an 8 bit image apart.
+static inline uint32_t quantize_key(float v){
+    int q = int(v * 65535 + 0.5f);
+    return q < 0 ? 0 : (q > 65535 ? 65535 : q);
+}
+
+//------------------------------------------[Span Sorting]------------------------------------------
+
+//Spans shorter than this are insertion sorted; longer ones go through two 8 bit radix passes.
+#define RADIX_MIN 48
+
+//Stable sort of (key << 32 | position) entries by key.
+static void sort_entries(uint64_t* a, int n, std::vector<uint64_t>& tmp){
+    if(n < RADIX_MIN){
+        for(int i = 1; i < n; i++){
+            uint64_t v = a[i];
+            int k = i - 1;
+            while(k >= 0 && (a[k] >> 32) > (v >> 32)){
+                a[k + 1] = a[k];
+                k--;
+            }
+            a[k + 1] = v;
+        }
+        return;
+    }
+    if(int(tmp.size()) < n) tmp.resize(n);
+    uint64_t* src = a;
+    uint64_t* dst = tmp.data();
+    for(int shift = 32; shift < 48; shift += 8){
+        int count[257] = {0};
+        for(int i = 0; i < n; i++) count[((src[i] >> shift) & 0xff) + 1]++;
+        for(int d = 0; d < 256; d++) count[d + 1] += count[d];
+        for(int i = 0; i < n; i++) dst[count[(src[i] >> shift) & 0xff]++] = src[i];
+        std::swap(src, dst);
+    }
+    //after an even number of passes the result is back in <a>
+}
+
+//-------------------------------------------[Sort Lines]-------------------------------------------
+
+//Pixels of the image are split into parallel lines that together cover every pixel exactly once.
+//Lines within 45 degrees of the horizontal step one column at a time, the others one row at a time;
+//the offset across the line is rounded from its slope.
+struct line_set{
+    bool by_column;     //lines step through rows rather than columns
+    double slope;
+    int lo, count;      //index of the first line, number of lines
+    int rows, cols;
+    ptrdiff_t step;
+
+    line_set(const image& img, double angle): rows(img.r()), cols(img.c()), step(img.y().step()) {
+        angle = fmod(angle, 180.0);
+        if(angle > 90) angle -= 180;
+        if(angle <= -90) angle += 180;
+        by_column = fabs(angle) > 45;
+        double a = angle * PI / 180;
+        slope = by_column ? cos(a) / sin(a) : tan(a);
+        const int along = by_column ? rows : cols;
+        const int across = by_column ? cols : rows;
+        int shift = lround((along - 1) * slope);
+        lo = MIN(0, shift);
+        count = across + abs(shift);
+    }
+
+    //Element offsets of line <k>, in order along the line.
+    void offsets(int k, std::vector<ptrdiff_t>& at) const {
+        at.clear();
+        const int along = by_column ? rows : cols;
+        const int across = by_column ? cols : rows;
+        for(int t = 0; t < along; t++){
+            int x = k + lo - lround(t * slope);
+            if(x < 0 || x >= across) continue;
+            at.push_back(by_column ? t * step + x : x * step + t);
+        }
+    }
+};
+
+//Positions along a row where the edge mask changes, from the runs of that row. Runs never touch, so
+//every start and end is a change.
+static void row_cuts(const edge_mask& edges, int row, int n, std::vector<int>& cuts){
+    cuts.clear();
+    for(int k = edges.begin[row]; k < edges.begin[row + 1]; k++){
+        cuts.push_back(edges.runs[k].start);
+        if(edges.runs[k].end < n) cuts.push_back(edges.runs[k].end);
+    }
+}
+
+//Sort the spans between edge transitions of every line by <opt.key>. A span runs from one change of
+//the edge mask to the next; the last pixel of a line always ends the final span without joining it.
+//Each span is sorted as compact (key, position) entries and every plane is then gathered once
+//through the sorted positions, so colour travels with its key. Lines are independent and are
+//processed in parallel.
+//
+//Rows take their span boundaries straight from the runs of the mask. Other directions look the
+//edges up in a bit-packed copy of it.
+void pixelsort(image& img, const edge_mask& edges, const sort_options& opt){
+    TRACE("pixelsort");
+    const line_set lines(img, opt.angle);
+    const bool rows = !lines.by_column && lines.slope == 0;
+    const bool color = img.color();
+    const int planes = color ? 4 : 1;
+    float* base[4] = {img[0], nullptr, nullptr, nullptr};
+    for(int p = 1; p < planes; p++) base[p] = img.channel(p - 1)[0];
+
+    //one bit per pixel, at the same offsets as the image planes
+    std::vector<uint8_t> bits;
+    if(!rows){
+        bits.assign((size_t(img.r()) * lines.step + 7) / 8, 0);
+        for(int i = 0; i < edges.rows; i++){
+            for(int k = edges.begin[i]; k < edges.begin[i + 1]; k++){
+                for(int j = edges.runs[k].start; j < edges.runs[k].end; j++){
+                    size_t o = i * lines.step + j;
+                    bits[o >> 3] |= 1 << (o & 7);
+                }
+            }
+        }
+    }
+
+    parallel_rows(lines.count, [&](int first, int last){
+        std::vector<ptrdiff_t> at;
+        std::vector<uint64_t> entries, tmp;
+        std::vector<float> scratch;
+        std::vector<int> cuts;
+        for(int k = first; k < last; k++){
+            lines.offsets(k, at);
+            const int n = at.size();
+            entries.resize(n);
+            scratch.resize(n);
+            for(int t = 0; t < n; t++){
+                const ptrdiff_t o = at[t];
+                float y = base[0][o];
+                float v = color ? key_value(opt.key, y, base[1][o], base[2][o], base[3][o])
+                                : key_value(opt.key, y, y, y, y);
+                entries[t] = uint64_t(quantize_key(v)) << 32 | uint32_t(t);
+            }
+            if(rows) row_cuts(edges, k, n, cuts);
+            else{
+                cuts.clear();
+                bool prev = false; //Default to the previous pixel not being an edge
+                for(int t = 0; t < n; t++){
+                    bool e = bits[at[t] >> 3] >> (at[t] & 7) & 1;
+                    if(e != prev) cuts.push_back(t);
+                    prev = e;
+                }
+            }
+            if(n && (cuts.empty() || cuts.back() != n - 1)) cuts.push_back(n - 1);
+            int offset = 0;
+            for(int t : cuts){
+                if(t - offset > 1){
+                    sort_entries(&entries[offset], t - offset, tmp);
+                    for(int p = 0; p < planes; p++){
+                        float* data = base[p];
+                        for(int q = offset; q < t; q++) scratch[q] = data[at[uint32_t(entries[q])]];
+                        for(int q = offset; q < t; q++) data[at[q]] = scratch[q];
+                    }
+                }
+                offset = t;
+            }
+        }
+    }, 1);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+
+template<typename T> class basic_image;
+typedef basic_image<float> image;
+struct edge_mask;
+
+//-------------------------------------------[Pixel Sorting]----------------------------------------
+
+enum sort_key { KEY_LUMA, KEY_RED, KEY_GREEN, KEY_BLUE, KEY_HUE, KEY_SATURATION, KEY_VALUE };
+
+//Pixels are sorted along parallel lines at <angle> degrees counterclockwise from the horizontal: 0
+//sorts rows left to right, 90 sorts columns top to bottom.
+struct sort_options{
+    sort_key key = KEY_LUMA;
+    double angle = 0;
+};
+
+bool find_sort_key(const std::string&, sort_key&);
+bool parse_sort_mode(const std::string&, double& angle);
+void pixelsort(image&, const edge_mask&, const sort_options& = sort_options());
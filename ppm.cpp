@@ -1,119 +1,838 @@
 #include "ppm.hpp"
 #include "image.hpp"
+#include "trace.hpp"
 
+#include <cctype>
+#include <cerrno>
+#include <charconv>     //from_chars()
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <sstream>
 #include <fstream>
+#include <vector>
 
-void getline_ignore_comments(std::istream& in, std::string& l){
-    char c = '#';
-    do{
-        std::getline(in, l);
-    } while(l[0] == c);  //loop until <line> is not a comment.
+#include <fcntl.h>      //open()
+#include <sys/mman.h>   //mmap()
+#include <sys/stat.h>
+#include <unistd.h>
+
+//---------------------------------------------[Errors]---------------------------------------------
+
+//The parsers report bad input by throwing a pnm_error. The public readers turn it into the message and
+//exit status the program has always given, except loadppm(), which hands the failure to its caller.
+struct pnm_error{
+    const char* message;
+    int status;
+};
+
+[[noreturn]] static void fail(const char* message, int status){
+    throw pnm_error{message, status};
 }
 
-image openppm(std::string fname){
-    std::filebuf infile;
-    image img;
-    if (infile.open(fname, std::ios::in)){
-        std::istream is(&infile);
-        img = readppm(is);
-        infile.close();
+template<typename F>
+static auto or_exit(F f) -> decltype(f()){
+    try{
+        return f();
     }
-    else {
-        std::cerr << "Unable to open file.\n";
-        exit(1);
+    catch(const pnm_error& e){
+        std::cerr << e.message << "\n";
+        exit(e.status);
     }
-    return img;
 }
 
-image readppm(std::istream& in){
-    std::string line;
-    //Get the magic number
-    getline_ignore_comments(in, line);
-    std::string format = line;
+//------------------------------------------[Header Parsing]----------------------------------------
+
+//Reads the next header token, skipping whitespace and comments. Returns false if the buffer ends
+//before the token is terminated.
+static bool header_token(const char*& p, const char* end, std::string& tok){
+    while(p < end){
+        if(*p == '#') while(p < end && *p != '\n') p++;
+        else if(isspace((unsigned char)*p)) p++;
+        else break;
+    }
+    const char* start = p;
+    while(p < end && !isspace((unsigned char)*p) && *p != '#') p++;
+    if(p == end) return false;
+    tok.assign(start, p);
+    return true;
+}
+
+//Parses a complete PNM header from [p, end). Returns a pointer to the first byte of pixel data, or
+//nullptr if the header is not complete yet.
+static const char* header(const char* p, const char* end, pnm_header& h){
+    std::string tok;
+    if(!header_token(p, end, tok)) return nullptr;
+    if(tok.size() != 2 || tok[0] != 'P' || tok[1] < '1' || tok[1] > '6'){
+        fail("Unknown file type.", 2);
+    }
+    h.format = tok;
+    if(!header_token(p, end, tok)) return nullptr;
+    h.width = atoi(tok.c_str());
+    if(!header_token(p, end, tok)) return nullptr;
+    h.height = atoi(tok.c_str());
+    h.maxval = 1;
+    if(h.format != "P1" && h.format != "P4"){
+        if(!header_token(p, end, tok)) return nullptr;
+        h.maxval = atoi(tok.c_str());
+    }
+    if(h.width <= 0 || h.height <= 0 || h.maxval <= 0 || h.maxval > 65535){
+        fail("Malformed header.", 2);
+    }
+    return p + 1; //exactly one whitespace character separates the header from the data
+}
+
+const char* parse_header(const char* p, const char* end, pnm_header& h){
+    return or_exit([&]{ return header(p, end, h); });
+}
+
+//Pulls bytes from <in> one at a time until a whole header has been seen, so that the stream is left
+//positioned at the first byte of pixel data.
+static bool read_header(std::istream& in, pnm_header& h){
+    std::string buf;
+    char c;
+    while(in.get(c)){
+        buf += c;
+        if(isspace((unsigned char)c) && header(buf.data(), buf.data() + buf.size(), h)){
+            return true;
+        }
+    }
+    return false;
+}
+
+bool pnm_header::raw() const {
+    return format[1] >= '4';
+}
+
+int pnm_header::channels() const {
+    return (format == "P3" || format == "P6") ? 3 : 1;
+}
 
-    //Get the width and height of the image
-    getline_ignore_comments(in, line);
-    std::stringstream linestream(line);
-    int width, height;
-    linestream >> width >> height;
+//Bytes per row of binary pixel data.
+size_t pnm_header::rowbytes() const {
+    if(format == "P4") return (width + 7) / 8;
+    return size_t(width) * channels() * (maxval > 255 ? 2 : 1);
+}
 
-    //get the max brightness value
-    getline_ignore_comments(in, line);
-    double max = std::stod(line);
+//------------------------------------------[Pixel Decoding]----------------------------------------
 
-    std::vector<std::vector<pixel> > pixdata;
-    std::string lines = "";
+static void prepare(const pnm_header& h, image& img){
+    img.reshape(h.height, h.width, h.channels() == 3);
+    img.set_format(h.format);
+    img.set_maxval(h.format == "P1" || h.format == "P4" ? 255 : h.maxval);
+}
 
-    while(std::getline(in, line)){
-        if(line[0] != '#') lines += line + " ";
+//Decodes one row of binary samples straight into the image planes.
+static void decode_row(const unsigned char* src, image& img, int row, const pnm_header& h){
+    const float scale = 1.0f / h.maxval;
+    const int w = h.width;
+    if(h.format == "P4"){
+        float* y = img[row];
+        for(int j = 0; j < w; j++){
+            y[j] = (src[j >> 3] >> (7 - (j & 7))) & 1 ? 0.0f : 1.0f; //1 is black
+        }
+        return;
+    }
+    float* out[3] = {img[row], nullptr, nullptr};
+    if(h.channels() == 3){
+        for(int k = 0; k < 3; k++) out[k] = img.channel(k)[row];
+    }
+    const int n = h.channels();
+    if(h.maxval > 255){
+        //16 bit samples are big-endian
+        for(int j = 0; j < w; j++){
+            for(int k = 0; k < n; k++, src += 2){
+                out[k][j] = ((src[0] << 8) | src[1]) * scale;
+            }
+        }
     }
+    else{
+        for(int j = 0; j < w; j++){
+            for(int k = 0; k < n; k++){
+                out[k][j] = *src++ * scale;
+            }
+        }
+    }
+}
+
+//------------------------------------------[Plain Tokenizer]---------------------------------------
 
-    linestream = std::stringstream(lines);
-    std::vector<pixel> temp;
-    double r, g, b, y;
+#define CHUNK_SIZE (1 << 16)
 
+//Single-pass tokenizer for plain PNM pixel data. Stream input is consumed in fixed-size chunks and a
+//token that straddles a chunk boundary is carried over to the next chunk, so memory use is constant
+//regardless of file size. In-memory input is tokenized in place.
+//
+//Reading from a file descriptor, the tokenizer also hands out headers and binary rows, so that one
+//buffer can carry any number of images back to back.
+class tokenizer{
+    private:
+        std::istream* in;
+        int fd;
+        bool eof;
+        std::vector<char> buf;
+        const char* p;
+        const char* end;
+
+        //Keep the unconsumed tail and append the next chunk after it. The buffer grows if the tail
+        //already fills it.
+        bool refill(){
+            if(!in && fd < 0) return false;
+            if(in && !*in) return false;
+            if(fd >= 0 && eof) return false;
+            size_t keep = end - p;
+            memmove(buf.data(), p, keep);
+            if(keep == buf.size()) buf.resize(2 * buf.size());
+            size_t got = 0;
+            if(in){
+                in->read(buf.data() + keep, buf.size() - keep);
+                got = in->gcount();
+            }
+            else{
+                ssize_t n;
+                while((n = read(fd, buf.data() + keep, buf.size() - keep)) < 0 && errno == EINTR);
+                if(n <= 0) eof = true;
+                else got = n;
+            }
+            p = buf.data();
+            end = p + keep + got;
+            return got > 0;
+        }
+
+        bool more() const {
+            return in ? bool(*in) : (fd >= 0 && !eof);
+        }
+
+        //Skip whitespace and comments. Comments may appear anywhere and run to the end of the line.
+        bool skip(){
+            for(;;){
+                while(p < end && isspace((unsigned char)*p)) p++;
+                if(p == end){
+                    if(!refill()) return false;
+                    continue;
+                }
+                if(*p != '#') return true;
+                const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+                p = nl ? nl + 1 : end;
+            }
+        }
+    public:
+        tokenizer(std::istream& s): in(&s), fd(-1), eof(false), buf(CHUNK_SIZE), p(buf.data()), end(buf.data()) {}
+        tokenizer(int f): in(nullptr), fd(f), eof(false), buf(CHUNK_SIZE), p(buf.data()), end(buf.data()) {}
+        tokenizer(const char* begin, const char* stop): in(nullptr), fd(-1), eof(false), p(begin), end(stop) {}
+
+        bool next(int& val){
+            if(!skip()) return false;
+            std::from_chars_result res = std::from_chars(p, end, val);
+            //the number may continue in the next chunk, and a pipe may hand it over a few digits at a time
+            while(res.ptr == end && more() && refill()){
+                res = std::from_chars(p, end, val);
+            }
+            if(res.ec != std::errc()){
+                fail("Malformed pixel data.", 2);
+            }
+            p = res.ptr;
+            return true;
+        }
+
+        //P1 digits need not be separated by whitespace, so bits are read one character at a time.
+        //Anything but 0 or 1 is malformed.
+        bool next_bit(int& val){
+            if(!skip()) return false;
+            if(*p != '0' && *p != '1') fail("Malformed pixel data.", 2);
+            val = *p++ == '1';
+            return true;
+        }
+
+        //Parse the next header. Returns false if the input ends before another image starts.
+        bool header(pnm_header& h){
+            if(!skip()) return false;
+            const char* data;
+            while(!(data = ::header(p, end, h))){
+                if(!refill()){
+                    fail("Malformed header.", 2);
+                }
+            }
+            p = data;
+            return true;
+        }
+
+        //The next <n> bytes of binary data, or nullptr if the input ends first.
+        const char* take(size_t n){
+            while(size_t(end - p) < n){
+                if(!refill()) return nullptr;
+            }
+            const char* data = p;
+            p += n;
+            return data;
+        }
+};
+
+//Plain (ASCII) pixel data, written directly into the image planes.
+static void read_plain(tokenizer& tok, image& img, const pnm_header& h){
+    const float scale = 1.0f / h.maxval;
+    int r, g, b, y;
+    bool ok = true;
+
+    //Bitmap. 1 is black.
+    if(h.format == "P1"){
+        for(int i = 0; i < h.height && ok; i++){
+            float* row = img[i];
+            for(int j = 0; j < h.width && (ok = tok.next_bit(y)); j++){
+                row[j] = y ? 0.0f : 1.0f;
+            }
+        }
+    }
     //Grayscale image
-    if(format == "P2"){
-        while(linestream >> y && pixdata.size() < height){
-            temp.push_back(pixel(y/max));
-            if(temp.size() == width){
-                pixdata.push_back(temp);
-                temp.clear();
+    else if(h.format == "P2"){
+        for(int i = 0; i < h.height && ok; i++){
+            float* row = img[i];
+            for(int j = 0; j < h.width && (ok = tok.next(y)); j++){
+                row[j] = y * scale;
             }
         }
     }
     //Color Image
-    else if(format == "P3"){
-        while(linestream >> r >> g >> b && pixdata.size() < height){
-            temp.push_back(pixel(r/max, g/max, b/max));
-            if(temp.size() == width){
-                pixdata.push_back(temp);
-                temp.clear();
+    else if(h.format == "P3"){
+        for(int i = 0; i < h.height && ok; i++){
+            float* red = img.channel(0)[i];
+            float* grn = img.channel(1)[i];
+            float* blu = img.channel(2)[i];
+            for(int j = 0; j < h.width && (ok = tok.next(r) && tok.next(g) && tok.next(b)); j++){
+                red[j] = r * scale;
+                grn[j] = g * scale;
+                blu[j] = b * scale;
             }
         }
     }
+    if(!ok){
+        fail("Unexpected end of file.", 2);
+    }
+}
+
+//--------------------------------------------[Readers]---------------------------------------------
+
+//Decodes an image held entirely in memory into <img>, reusing its planes if they already have the
+//right size. Binary data is converted directly from <data>.
+static void decode(const char* data, size_t len, image& img){
+    TRACE("decodeppm");
+    pnm_header h;
+    const char* end = data + len;
+    const char* p = header(data, end, h);
+    if(!p){
+        fail("Malformed header.", 2);
+    }
+    prepare(h, img);
+    if(h.raw()){
+        size_t rowbytes = h.rowbytes();
+        if(size_t(end - p) < rowbytes * h.height){
+            fail("Unexpected end of file.", 2);
+        }
+        for(int i = 0; i < h.height; i++, p += rowbytes){
+            decode_row(reinterpret_cast<const unsigned char*>(p), img, i, h);
+        }
+    }
     else{
-        std::cerr << "Unknown file type.\n";
-        exit(2);
+        tokenizer tok(p, end);
+        read_plain(tok, img, h);
     }
+    img.update_luma();
+}
+
+void decodeppm(const char* data, size_t len, image& img){
+    or_exit([&]{ decode(data, len, img); });
+}
 
-    image img(pixdata);
-    img.set_format(format);
+image decodeppm(const char* data, size_t len){
+    image img;
+    decodeppm(data, len, img);
     return img;
 }
 
-int printppm(const image& img){
-    if(img.get_format() == "P1"){
-        std::cout << "P1\n" << img.c() << ' ' << img.r() << "\n";
-        for(int i = 0; i < img.r(); i++){
-            for(pixel pix : img[i]){
-                std::cout << int(1-pix.y) << ' ';
+static void read_stream(std::istream&, image&);
+
+//Files are memory-mapped and decoded in place. Anything that cannot be mapped (pipes, devices)
+//falls back to the stream reader.
+static void load(const std::string& fname, image& img){
+    int fd = open(fname.c_str(), O_RDONLY);
+    if(fd < 0){
+        fail("Unable to open file.", 1);
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if(map == MAP_FAILED){
+        close(fd);
+        std::filebuf infile;
+        if(!infile.open(fname, std::ios::in | std::ios::binary)){
+            fail("Unable to open file.", 1);
+        }
+        std::istream is(&infile);
+        read_stream(is, img);
+        return;
+    }
+    close(fd);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    try{
+        decode(static_cast<const char*>(map), st.st_size, img);
+    }
+    catch(const pnm_error&){
+        munmap(map, st.st_size);
+        throw;
+    }
+    munmap(map, st.st_size);
+}
+
+void openppm(std::string fname, image& img){
+    or_exit([&]{ load(fname, img); });
+}
+
+//As openppm(), but returns false instead of exiting if the file cannot be opened or is not a
+//well-formed image, for callers that go on to other files.
+bool loadppm(const std::string& fname, image& img){
+    try{
+        load(fname, img);
+        return true;
+    }
+    catch(const pnm_error&){
+        return false;
+    }
+}
+
+image openppm(std::string fname){
+    image img;
+    openppm(fname, img);
+    return img;
+}
+
+mapped_pnm::~mapped_pnm(){
+    if(map) munmap(const_cast<char*>(map), len);
+}
+
+//Map <fname> and parse its header. Returns false if the file cannot be mapped or holds plain text,
+//whose rows cannot be found without reading everything before them.
+bool mapped_pnm::open(const std::string& fname){
+    return or_exit([&]{ return map_file(fname); });
+}
+
+bool mapped_pnm::map_file(const std::string& fname){
+    int fd = ::open(fname.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    void* m = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+        m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(m == MAP_FAILED) return false;
+    map = static_cast<const char*>(m);
+    len = st.st_size;
+    pixels = ::header(map, map + len, h);
+    if(!pixels){
+        fail("Malformed header.", 2);
+    }
+    if(!h.raw()) return false;
+    if(size_t(map + len - pixels) < h.rowbytes() * h.height){
+        fail("Unexpected end of file.", 2);
+    }
+    madvise(m, len, MADV_SEQUENTIAL);
+    return true;
+}
+
+//Decode rows [first, first + count) into <img>, which becomes <count> rows tall.
+void mapped_pnm::read(int first, int count, image& img){
+    TRACE("read_rows");
+    img.reshape(count, h.width, h.channels() == 3);
+    img.set_format(h.format);
+    img.set_maxval(h.format == "P4" ? 255 : h.maxval);
+    const size_t rowbytes = h.rowbytes();
+    const char* p = pixels + rowbytes * first;
+    for(int i = 0; i < count; i++, p += rowbytes){
+        decode_row(reinterpret_cast<const unsigned char*>(p), img, i, h);
+    }
+    img.update_luma();
+}
+
+//Let the kernel drop the pages of every row above <row>. They are read from the file again if needed.
+void mapped_pnm::release(int row){
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t end = (pixels - map + h.rowbytes() * row) / page * page;
+    if(end) madvise(const_cast<char*>(map), end, MADV_DONTNEED);
+}
+
+static void read_stream(std::istream& in, image& img){
+    TRACE("readppm");
+    pnm_header h;
+    if(!read_header(in, h)){
+        fail("Unknown file type.", 2);
+    }
+    prepare(h, img);
+    if(h.raw()){
+        std::vector<unsigned char> row(h.rowbytes());
+        for(int i = 0; i < h.height; i++){
+            if(!in.read(reinterpret_cast<char*>(row.data()), row.size())){
+                fail("Unexpected end of file.", 2);
+            }
+            decode_row(row.data(), img, i, h);
+        }
+    }
+    else{
+        tokenizer tok(in);
+        read_plain(tok, img, h);
+    }
+    img.update_luma();
+}
+
+void readppm(std::istream& in, image& img){
+    or_exit([&]{ read_stream(in, img); });
+}
+
+image readppm(std::istream& in){
+    image img;
+    readppm(in, img);
+    return img;
+}
+
+frame_reader::frame_reader(int fd): tok(new tokenizer(fd)) {}
+
+frame_reader::~frame_reader(){}
+
+//Decode the next image into <img>. Returns false once the input ends cleanly between two images.
+bool frame_reader::next(image& img){
+    return or_exit([&]{ return decode_next(img); });
+}
+
+bool frame_reader::decode_next(image& img){
+    TRACE("read_frame");
+    pnm_header h;
+    if(!tok->header(h)) return false;
+    prepare(h, img);
+    if(h.raw()){
+        size_t rowbytes = h.rowbytes();
+        for(int i = 0; i < h.height; i++){
+            const char* row = tok->take(rowbytes);
+            if(!row){
+                fail("Unexpected end of file.", 2);
+            }
+            decode_row(reinterpret_cast<const unsigned char*>(row), img, i, h);
+        }
+    }
+    else{
+        read_plain(*tok, img, h);
+    }
+    img.update_luma();
+    return true;
+}
+
+//--------------------------------------------[Writers]---------------------------------------------
+
+#define WRITE_BUFFER (1 << 20)
+
+//Scale a [0, 1] sample to the nearest integer in [0, max], so that decoded samples come back unchanged.
+static inline int quantize(float v, int max){
+    int q = int(v * max + 0.5f);
+    return q < 0 ? 0 : (q > max ? max : q);
+}
+
+//Integer samples are already on the scale of maxval.
+static inline int quantize(uint8_t v, int){
+    return v;
+}
+
+static inline int quantize(uint16_t v, int){
+    return v;
+}
+
+//Whether a sample is black in a PBM image: float samples of 0, or integer samples of 0.
+static inline bool ink(float v){
+    return int(1 - v);
+}
+
+template<typename T>
+static inline bool ink(T v){
+    return v == 0;
+}
+
+//The PBM bits of pixels [j, j + 8) of <row>, the leftmost in the high bit. Pixels past <w> are 0.
+template<typename T>
+static inline unsigned char pbm_byte(const T* row, int j, int w){
+    unsigned char byte = 0;
+    for(int k = 0; k < 8 && j + k < w; k++) byte |= ink(row[j + k]) << (7 - k);
+    return byte;
+}
+
+//Binary counterparts of the plain formats: P1 -> P4, P2 -> P5, P3 -> P6.
+static std::string raw_format(std::string f){
+    if(f == "P1" || f == "P2" || f == "P3") f[1] += 3;
+    return f;
+}
+
+//Decimal text for every 8 bit sample, each followed by a space, plus a table of digit pairs for
+//wider samples.
+struct digit_tables{
+    char small[256][4];
+    unsigned char len[256];
+    char pairs[200];
+    digit_tables(){
+        for(int i = 0; i < 256; i++){
+            len[i] = snprintf(small[i], sizeof(small[i]), "%d", i);
+        }
+        for(int i = 0; i < 100; i++){
+            pairs[2*i] = '0' + i / 10;
+            pairs[2*i + 1] = '0' + i % 10;
+        }
+    }
+};
+static const digit_tables digits;
+
+//Plain PBM text for every byte of packed bits: eight digits, each followed by a space.
+struct pbm_table{
+    char text[256][16];
+    pbm_table(){
+        for(int b = 0; b < 256; b++){
+            for(int k = 0; k < 8; k++){
+                text[b][2*k] = '0' + ((b >> (7 - k)) & 1);
+                text[b][2*k + 1] = ' ';
+            }
+        }
+    }
+};
+static const pbm_table pbm;
+
+//One output buffer per thread, kept from one image to the next.
+static std::vector<char>& write_buffer(){
+    static thread_local std::vector<char> buf(WRITE_BUFFER);
+    return buf;
+}
+
+//Accumulates output in one large buffer and hands it to the kernel with as few write(2) calls as
+//possible. Nothing is flushed until the buffer is full or the writer is done.
+class writer{
+    private:
+        int fd;
+        std::vector<char>& buf;
+        size_t used;
+        bool failed;
+    public:
+        writer(int f): fd(f), buf(write_buffer()), used(0), failed(false) {}
+        ~writer(){ flush(); }
+
+        bool flush(){
+            const char* p = buf.data();
+            while(used && !failed){
+                ssize_t n = write(fd, p, used);
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0){
+                    failed = true;
+                    break;
+                }
+                p += n;
+                used -= n;
+            }
+            used = 0;
+            return !failed;
+        }
+        bool ok() const { return !failed; }
+
+        //Make sure at least <n> bytes are free and return a pointer to them.
+        char* reserve(size_t n){
+            if(used + n > buf.size()) flush();
+            if(n > buf.size()) buf.resize(n);
+            return buf.data() + used;
+        }
+        void commit(size_t n){ used += n; }
+
+        void put(const char* s, size_t n){
+            memcpy(reserve(n), s, n);
+            commit(n);
+        }
+        void put(char c){
+            *reserve(1) = c;
+            commit(1);
+        }
+
+        //Decimal text of <v> followed by a space.
+        void put_sample(unsigned v){
+            char* out = reserve(8);
+            if(v < 256){
+                memcpy(out, digits.small[v], 4);
+                out[digits.len[v]] = ' ';
+                commit(digits.len[v] + 1);
+                return;
             }
-            std::cout << std::endl;
+            char tmp[8];
+            char* t = tmp + sizeof(tmp);
+            while(v >= 100){
+                t -= 2;
+                memcpy(t, digits.pairs + 2 * (v % 100), 2);
+                v /= 100;
+            }
+            if(v >= 10){
+                t -= 2;
+                memcpy(t, digits.pairs + 2 * v, 2);
+            }
+            else *--t = '0' + v;
+            size_t n = tmp + sizeof(tmp) - t;
+            memcpy(out, t, n);
+            out[n] = ' ';
+            commit(n + 1);
         }
-        return 0;
+};
+
+static void write_header(writer& out, const std::string& format, int rows, int cols, int maxval){
+    char header[64];
+    int n;
+    if(format == "P1" || format == "P4"){
+        n = snprintf(header, sizeof(header), "%s\n%d %d\n", format.c_str(), cols, rows);
     }
-    if(img.get_format() == "P2"){
-        std::cout << "P2\n" << img.c() << ' ' << img.r() << "\n255\n";
+    else{
+        n = snprintf(header, sizeof(header), "%s\n%d %d\n%d\n", format.c_str(), cols, rows, maxval);
+    }
+    out.put(header, n);
+}
+
+//Red, green and blue planes to write. Grayscale images are written with luma in all three channels.
+template<typename T>
+static void color_planes(const basic_image<T>& img, const plane<T>* planes[3]){
+    for(int k = 0; k < 3; k++){
+        planes[k] = img.color() ? &img.channel(k) : &img.y();
+    }
+}
+
+template<typename T>
+static void write_raw(writer& out, const basic_image<T>& img, const std::string& format){
+    const int max = img.get_maxval();
+    const int w = img.c();
+    if(format == "P4"){
+        const size_t rowbytes = (w + 7) / 8;
         for(int i = 0; i < img.r(); i++){
-            for(pixel pix : img[i]){
-                std::cout << int(pix.y * 255) << ' ';
+            unsigned char* dst = reinterpret_cast<unsigned char*>(out.reserve(rowbytes));
+            const T* y = img[i];
+            for(size_t b = 0; b < rowbytes; b++) dst[b] = pbm_byte(y, 8 * b, w);
+            out.commit(rowbytes);
+        }
+        return;
+    }
+    const plane<T>* planes[3] = {&img.y(), nullptr, nullptr};
+    const int n = format == "P6" ? 3 : 1;
+    if(n == 3) color_planes(img, planes);
+    const int bps = max > 255 ? 2 : 1;
+    const size_t rowbytes = size_t(w) * n * bps;
+    for(int i = 0; i < img.r(); i++){
+        unsigned char* dst = reinterpret_cast<unsigned char*>(out.reserve(rowbytes));
+        for(int k = 0; k < n; k++){
+            const T* src = (*planes[k])[i];
+            unsigned char* d = dst + k * bps;
+            if(bps == 2){
+                //16 bit samples are big-endian
+                for(int j = 0; j < w; j++, d += 2 * n){
+                    int q = quantize(src[j], max);
+                    d[0] = q >> 8;
+                    d[1] = q & 0xff;
+                }
+            }
+            else{
+                for(int j = 0; j < w; j++, d += n){
+                    d[0] = quantize(src[j], max);
+                }
             }
-            std::cout << std::endl;
         }
-        return 0;
+        out.commit(rowbytes);
     }
-    if(img.get_format() == "P3"){
-        std::cout << "P3\n" << img.c() << ' ' << img.r() << "\n255\n";
+}
+
+//P1 rows are packed to bits eight pixels at a time and each byte is expanded through a table.
+template<typename T>
+static void write_plain(writer& out, const basic_image<T>& img, const std::string& format){
+    const int max = img.get_maxval();
+    if(format == "P1"){
+        const int w = img.c();
         for(int i = 0; i < img.r(); i++){
-            for(pixel pix : img[i]){
-                std::cout << int(pix.r * 255) << ' ' << int(pix.g * 255) << ' ' << int(pix.b * 255) << ' ';
+            const T* row = img[i];
+            char* line = out.reserve(2 * w + 16);
+            for(int j = 0; j < w; j += 8) memcpy(line + 2 * j, pbm.text[pbm_byte(row, j, w)], 16);
+            line[2 * w] = '\n';
+            out.commit(2 * w + 1);
+        }
+        return;
+    }
+    const plane<T>* planes[3] = {&img.y(), nullptr, nullptr};
+    const int n = format == "P3" ? 3 : 1;
+    if(n == 3) color_planes(img, planes);
+    for(int i = 0; i < img.r(); i++){
+        for(int j = 0; j < img.c(); j++){
+            for(int k = 0; k < n; k++){
+                out.put_sample(quantize((*planes[k])[i][j], max));
             }
-            std::cout << std::endl;
         }
-        return 0;
+        out.put('\n');
     }
-    return 1;
 }
+
+//Write the image to a file descriptor in its own format, or in the binary equivalent when <raw> is
+//set. Returns nonzero if the format is unknown or the write failed.
+template<typename T>
+int writeppm(const basic_image<T>& img, int fd, bool raw){
+    TRACE("writeppm");
+    std::string format = raw ? raw_format(img.get_format()) : img.get_format();
+    if(format.size() != 2 || format[0] != 'P' || format[1] < '1' || format[1] > '6') return 1;
+    writer out(fd);
+    write_header(out, format, img.r(), img.c(), img.get_maxval());
+    if(format[1] >= '4') write_raw(out, img, format);
+    else write_plain(out, img, format);
+    return out.flush() ? 0 : 1;
+}
+
+template<typename T>
+int saveppm(const basic_image<T>& img, std::string fname, bool raw){
+    int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        std::cerr << "Unable to open output file.\n";
+        return 1;
+    }
+    int ret = writeppm(img, fd, raw);
+    if(close(fd) != 0) ret = 1;
+    return ret;
+}
+
+template<typename T>
+int printppm(const basic_image<T>& img, bool raw){
+    std::cout.flush();
+    return writeppm(img, STDOUT_FILENO, raw);
+}
+
+band_writer::band_writer(int f, const std::string& fmt, int rows, int cols, int maxval, bool raw):
+    fd(f), format(raw ? raw_format(fmt) : fmt), failed(false)
+{
+    if(format.size() != 2 || format[0] != 'P' || format[1] < '1' || format[1] > '6'){
+        failed = true;
+        return;
+    }
+    writer out(fd);
+    write_header(out, format, rows, cols, maxval);
+    failed = !out.flush();
+}
+
+//Write the rows of <band>, which must be as wide as the image and have its maxval.
+template<typename T>
+int band_writer::write(const basic_image<T>& band){
+    if(failed) return 1;
+    TRACE("write_rows");
+    writer out(fd);
+    if(format[1] >= '4') write_raw(out, band, format);
+    else write_plain(out, band, format);
+    failed = !out.flush();
+    return failed;
+}
+
+#define INSTANTIATE_WRITERS(T) \
+    template int writeppm(const basic_image<T>&, int, bool); \
+    template int saveppm(const basic_image<T>&, std::string, bool); \
+    template int printppm(const basic_image<T>&, bool); \
+    template int band_writer::write(const basic_image<T>&);
+
+INSTANTIATE_WRITERS(float)
+INSTANTIATE_WRITERS(uint8_t)
+INSTANTIATE_WRITERS(uint16_t)
@@ -1,11 +1,77 @@
 #pragma once
 
+#include <cstddef>
+#include <memory>
 #include <vector>
 #include <string>
 
-class image;
-struct pixel;
+template<typename T> class basic_image;
+typedef basic_image<float> image;
+class tokenizer;
 
+struct pnm_header{
+    std::string format;
+    int width, height, maxval;
+    bool raw() const;
+    int channels() const;
+    size_t rowbytes() const;
+};
+
+const char* parse_header(const char*, const char*, pnm_header&);
+image decodeppm(const char*, size_t);
 image readppm(std::istream&);
 image openppm(std::string);
-int printppm(const image&);
+void decodeppm(const char*, size_t, image&);
+void readppm(std::istream&, image&);
+void openppm(std::string, image&);
+bool loadppm(const std::string&, image&);
+
+//The writers take images with float, uint8_t or uint16_t samples.
+template<typename T> int printppm(const basic_image<T>&, bool raw = false);
+template<typename T> int writeppm(const basic_image<T>&, int fd, bool raw = false);
+template<typename T> int saveppm(const basic_image<T>&, std::string, bool raw = false);
+
+//Reads any number of images stored back to back in one stream, such as the frames that ffmpeg
+//writes with -f image2pipe.
+class frame_reader{
+    private:
+        std::unique_ptr<tokenizer> tok;
+        bool decode_next(image&);
+    public:
+        frame_reader(int fd);
+        ~frame_reader();
+        bool next(image&);
+};
+
+//A binary PNM file mapped into memory and decoded a band of rows at a time, for images too large to
+//hold whole. Rows that have been used can be released, so the file is never resident all at once.
+class mapped_pnm{
+    private:
+        const char* map;
+        size_t len;
+        const char* pixels;
+        pnm_header h;
+        bool map_file(const std::string& fname);
+    public:
+        mapped_pnm(): map(nullptr), len(0), pixels(nullptr) {}
+        ~mapped_pnm();
+        mapped_pnm(const mapped_pnm&) = delete;
+        mapped_pnm& operator=(const mapped_pnm&) = delete;
+        bool open(const std::string& fname);
+        const pnm_header& header() const { return h; }
+        void read(int first, int count, image&);
+        void release(int row);
+};
+
+//Writes one image a band of rows at a time. The header goes out when the writer is made; the bands
+//must add up to <rows> rows. Bands with float, uint8_t or uint16_t samples can be written.
+class band_writer{
+    private:
+        int fd;
+        std::string format;
+        bool failed;
+    public:
+        band_writer(int fd, const std::string& format, int rows, int cols, int maxval, bool raw = false);
+        template<typename T> int write(const basic_image<T>& band);
+        bool ok() const { return !failed; }
+};
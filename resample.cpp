@@ -0,0 +1,150 @@
+#include <cmath>
+#include <vector>
+
+#include "image.hpp"
+#include "imgutils.hpp"
+#include "resample.hpp"
+#include "threads.hpp"
+#include "trace.hpp"
+
+//------------------------------------------[Weight Tables]-----------------------------------------
+
+//Source taps for every output index along one axis. Output i reads source indices
+//first[i] .. first[i] + count[i] - 1 with weights w[i * taps ...], which sum to 1.
+struct weight_table{
+    int taps;
+    std::vector<int> first, count;
+    std::vector<float> w;
+};
+
+static double sinc(double x){
+    if(x == 0) return 1;
+    x *= PI;
+    return sin(x) / x;
+}
+
+//Reach of each filter on either side of the centre, before widening.
+static double radius(resample_filter f){
+    return f == LANCZOS ? 3 : (f == BILINEAR ? 1 : 0.5);
+}
+
+static double filter_value(resample_filter f, double x){
+    x = fabs(x);
+    switch(f){
+        case BILINEAR:
+            return x < 1 ? 1 - x : 0;
+        case LANCZOS:
+            return x < 3 ? sinc(x) * sinc(x / 3) : 0;
+        default:
+            return 0;
+    }
+}
+
+//Weights mapping <in> samples onto <out>. Box weights are the exact overlap of each source pixel
+//with the output pixel's footprint; the other filters are sampled at source pixel centres. Taps
+//that fall outside the source are dropped and the rest renormalized.
+static weight_table make_table(int in, int out, resample_filter f){
+    const double scale = double(in) / out;
+    const double support = radius(f) * MAX(scale, 1.0);
+    weight_table t;
+    t.taps = int(ceil(2 * support)) + 2;
+    t.first.resize(out);
+    t.count.resize(out);
+    t.w.assign(size_t(out) * t.taps, 0.0f);
+    std::vector<double> tmp(t.taps);
+    for(int i = 0; i < out; i++){
+        int lo, hi;
+        if(f == BOX){
+            const double a = i * scale, b = (i + 1) * scale;
+            lo = int(floor(a));
+            hi = MIN(int(ceil(b)), in);
+            if(hi <= lo) hi = lo + 1;
+            for(int s = lo; s < hi; s++) tmp[s - lo] = MIN(b, s + 1.0) - MAX(a, double(s));
+        }
+        else{
+            const double centre = (i + 0.5) * scale - 0.5;
+            const double step = 1 / MAX(scale, 1.0);
+            lo = MAX(int(floor(centre - support)) + 1, 0);
+            hi = MIN(int(ceil(centre + support)), in);
+            if(hi <= lo){
+                lo = MIN(MAX(int(floor(centre + 0.5)), 0), in - 1);
+                hi = lo + 1;
+                tmp[0] = 1;
+            }
+            else{
+                for(int s = lo; s < hi; s++) tmp[s - lo] = filter_value(f, (s - centre) * step);
+            }
+        }
+        double sum = 0;
+        for(int s = lo; s < hi; s++) sum += tmp[s - lo];
+        if(sum == 0){
+            for(int s = lo; s < hi; s++) tmp[s - lo] = 1;
+            sum = hi - lo;
+        }
+        t.first[i] = lo;
+        t.count[i] = hi - lo;
+        for(int s = lo; s < hi; s++) t.w[size_t(i) * t.taps + s - lo] = tmp[s - lo] / sum;
+    }
+    return t;
+}
+
+//-------------------------------------------[Resampling]-------------------------------------------
+
+bool find_filter(const std::string& name, resample_filter& f){
+    if(name == "box") f = BOX;
+    else if(name == "bilinear") f = BILINEAR;
+    else if(name == "lanczos") f = LANCZOS;
+    else return false;
+    return true;
+}
+
+//Each output row is built from the source rows under its vertical footprint, added up into one
+//full-width row, and then filtered horizontally into place. Every source row is read once per output
+//row that covers it and nothing larger than a row is ever allocated.
+static void resample_plane(const plane<float>& src, plane<float>& dst, const weight_table& tx,
+                           const weight_table& ty){
+    const int w = src.c();
+    parallel_rows(dst.r(), [&](int first, int last){
+        std::vector<float> acc(w);
+        for(int i = first; i < last; i++){
+            const float* wy = &ty.w[size_t(i) * ty.taps];
+            const float* in = src[ty.first[i]];
+            for(int j = 0; j < w; j++) acc[j] = wy[0] * in[j];
+            for(int t = 1; t < ty.count[i]; t++){
+                const float k = wy[t];
+                in = src[ty.first[i] + t];
+                for(int j = 0; j < w; j++) acc[j] += k * in[j];
+            }
+            float* out = dst[i];
+            for(int j = 0; j < dst.c(); j++){
+                const float* wx = &tx.w[size_t(j) * tx.taps];
+                const float* a = &acc[tx.first[j]];
+                float v = 0;
+                for(int t = 0; t < tx.count[j]; t++) v += wx[t] * a[t];
+                out[j] = v;
+            }
+        }
+    });
+}
+
+//Resize <src> to <rows> x <cols> into <dst> in one pass per plane. Luma is resampled along with the
+//colour planes rather than recomputed from them.
+void resample(const image& src, image& dst, int rows, int cols, resample_filter f){
+    TRACE("resample");
+    rows = MAX(rows, 1);
+    cols = MAX(cols, 1);
+    weight_table tx = make_table(src.c(), cols, f);
+    weight_table ty = make_table(src.r(), rows, f);
+    dst.reshape(rows, cols, src.color());
+    dst.set_format(src.get_format());
+    dst.set_maxval(src.get_maxval());
+    resample_plane(src.y(), dst.y(), tx, ty);
+    if(!src.color()) return;
+    for(int k = 0; k < 3; k++) resample_plane(src.channel(k), dst.channel(k), tx, ty);
+}
+
+image resample(const image& src, int rows, int cols, resample_filter f){
+    image dst;
+    resample(src, dst, rows, cols, f);
+    return dst;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+template<typename T> class basic_image;
+typedef basic_image<float> image;
+
+//-------------------------------------------[Resampling]-------------------------------------------
+
+//BOX averages the source area each output pixel covers. BILINEAR and LANCZOS (3 lobes) are widened
+//by the scale factor when shrinking, so they average rather than skip source pixels.
+enum resample_filter { BOX, BILINEAR, LANCZOS };
+
+bool find_filter(const std::string&, resample_filter&);
+void resample(const image& src, image& dst, int rows, int cols, resample_filter f = BOX);
+image resample(const image& src, int rows, int cols, resample_filter f = BOX);
@@ -0,0 +1,54 @@
+#include <chrono>
+
+#include "rng.hpp"
+
+//--------------------------------------------[Random]----------------------------------------------
+
+static uint64_t seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+
+void set_seed(uint64_t s){
+    seed = s;
+}
+
+uint64_t get_seed(){
+    return seed;
+}
+
+static inline uint64_t rotl(uint64_t x, int k){
+    return (x << k) | (x >> (64 - k));
+}
+
+//SplitMix64 finalizer: a bijective mix in which every input bit affects every output bit.
+static inline uint64_t mix(uint64_t z){
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+uint64_t random_at(uint64_t key, uint64_t stream, uint64_t index){
+    return mix(mix(mix(key) ^ stream) + index * 0x9e3779b97f4a7c15ull);
+}
+
+xoshiro::xoshiro(uint64_t key, uint64_t stream){
+    uint64_t z = mix(mix(key) ^ stream);
+    for(int k = 0; k < 4; k++){
+        z += 0x9e3779b97f4a7c15ull;
+        s[k] = mix(z);
+    }
+}
+
+uint64_t xoshiro::next(){
+    const uint64_t out = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return out;
+}
+
+float xoshiro::unit(){
+    return (next() >> 40) * (1.0f / (1 << 24));
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+
+//--------------------------------------------[Random]----------------------------------------------
+
+//Every random effect draws from the one seed set here, so a given seed gives the same image for
+//any number of threads. Without set_seed() the seed is taken from the clock.
+void set_seed(uint64_t);
+uint64_t get_seed();
+
+//Counter-based generator: the value depends only on (seed, stream, index), so any pixel can be
+//drawn on its own, in any order.
+uint64_t random_at(uint64_t key, uint64_t stream, uint64_t index);
+
+//xoshiro256** for drawing a long sequence, e.g. one stream per row. Streams with different
+//numbers are independent.
+class xoshiro{
+    private:
+        uint64_t s[4];
+    public:
+        xoshiro(uint64_t key, uint64_t stream);
+        uint64_t next();
+        float unit();                   //uniform in [0, 1)
+};
@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include <sys/ioctl.h> //ioctl() and TIOCGWINSZ
+#include <unistd.h>
+
+#include "cache.hpp"
+#include "effects.hpp"
+#include "image.hpp"
+#include "imgutils.hpp"
+#include "terminal.hpp"
+#include "trace.hpp"
+
+//---------------------------------------------[Tables]---------------------------------------------
+
+//ASCII ramp from dark to light. Each pixel is drawn as two characters so that it comes out roughly
+//square.
+static const char ramp[] = " .:-=+*#%@";
+#define RAMP_SIZE (int(sizeof(ramp)) - 1)
+
+//UTF-8 encoding of every 8-dot braille pattern, U+2800 to U+28FF. The dots of pattern k are the
+//bits of k, arranged as follows:
+// 0 3
+// 1 4
+// 2 5
+// 6 7
+struct braille_table{
+    char utf8[256][3];
+    braille_table(){
+        for(int k = 0; k < 256; k++){
+            utf8[k][0] = char(0xe2);
+            utf8[k][1] = char(0xa0 | (k >> 6));
+            utf8[k][2] = char(0x80 | (k & 0x3f));
+        }
+    }
+};
+static const braille_table braille;
+
+//Decimal text of every 8 bit value, for colour escapes.
+struct decimal_table{
+    char text[256][3];
+    unsigned char len[256];
+    decimal_table(){
+        for(int i = 0; i < 256; i++){
+            char tmp[4];
+            len[i] = snprintf(tmp, sizeof(tmp), "%d", i);
+            memcpy(text[i], tmp, len[i]);
+        }
+    }
+};
+static const decimal_table decimal;
+
+#define NO_COLOR 0xffffffffu
+
+static inline uint32_t to_byte(float v){
+    int q = int(v * 255 + 0.5f);
+    return q < 0 ? 0 : (q > 255 ? 255 : q);
+}
+
+//-------------------------------------------[Renderer]---------------------------------------------
+
+terminal::terminal(int f, mode m, bool c, bool r, resample_filter rf): fd(f), style(m), color(c),
+                                                   redraw(r), filter(rf), cols(80), lines(24), width(0),
+                                                   height(0) {
+    struct winsize size;
+    if(ioctl(fd, TIOCGWINSZ, &size) == 0 && size.ws_col > 0){
+        cols = size.ws_col;
+        lines = size.ws_row;
+    }
+}
+
+//Leave the cursor below the last frame and visible again.
+terminal::~terminal(){
+    if(redraw && height){
+        if(color) put("\033[0m", 4);
+        move_to(height + 1, 1);
+        put("\033[?25h", 6);
+        emit();
+    }
+}
+
+void terminal::put(const char* s, size_t n){
+    buf.insert(buf.end(), s, s + n);
+}
+
+void terminal::put_number(int v){
+    char tmp[12];
+    put(tmp, snprintf(tmp, sizeof(tmp), "%d", v));
+}
+
+//24-bit foreground colour.
+void terminal::put_color(uint32_t rgb){
+    put("\033[38;2;", 7);
+    for(int shift = 16; shift >= 0; shift -= 8){
+        int v = (rgb >> shift) & 0xff;
+        put(decimal.text[v], decimal.len[v]);
+        put(shift ? ";" : "m", 1);
+    }
+}
+
+void terminal::move_to(int row, int col){
+    put("\033[", 2);
+    put_number(row);
+    put(";", 1);
+    put_number(col);
+    put("H", 1);
+}
+
+//Hand the whole buffer to the terminal.
+void terminal::emit(){
+    const char* p = buf.data();
+    size_t left = buf.size();
+    while(left){
+        ssize_t n = write(fd, p, left);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        p += n;
+        left -= n;
+    }
+    buf.clear();
+}
+
+//Shrink <img> to the widest size that fits across the terminal, keeping its aspect ratio. Frames that
+//are redrawn in place must fit its height as well. Images that already fit are used as they are.
+const image& terminal::fit(const image& img){
+    const int across = style == ASCII ? cols / 2 : cols * 2;
+    const int down = style == ASCII ? lines - 1 : (lines - 1) * 4;
+    double scale = 1;
+    if(img.c() > across) scale = double(across) / img.c();
+    if(redraw && img.r() * scale > down) scale = double(down) / img.r();
+    if(scale == 1) return img;
+    const int r = img.r() * scale, c = img.c() * scale;
+    //previews of still images are worth keeping; frames drawn in place are not
+    const bool cached = cache_enabled() && !redraw;
+    uint64_t key = 0;
+    if(cached){
+        key = cache_key(hash_image(img, true), "resample " + std::to_string(r) + "x" + std::to_string(c) +
+                        " " + std::to_string(filter));
+        if(load_image(key, small)) return small;
+    }
+    resample(img, small, r, c, filter);
+    if(cached) store_image(key, small);
+    return small;
+}
+
+//Copy the luma of <img> into <gray>, which the cell builders then dither.
+void terminal::dither_luma(const image& img){
+    gray.reshape(img.r(), img.c(), false);
+    for(int i = 0; i < img.r(); i++) std::copy(img[i], img[i] + img.c(), gray[i]);
+    if(style == ASCII) dither(gray, RAMP_SIZE);
+    else dither(gray);
+}
+
+//Channel <k> of pixel (i, j). Grayscale images repeat their luma.
+static inline float sample(const image& img, int k, int i, int j){
+    return img.color() ? img.channel(k)[i][j] : img[i][j];
+}
+
+//One cell per pixel, dithered to the levels of the ramp.
+void terminal::ascii_cells(const image& img){
+    dither_luma(img);
+    width = img.c();
+    height = img.r();
+    cells.resize(width * height);
+    for(int i = 0; i < height; i++){
+        for(int j = 0; j < width; j++){
+            uint32_t glyph = lround(gray[i][j] * (RAMP_SIZE - 1));
+            uint32_t rgb = 0;
+            if(color){
+                rgb = to_byte(sample(img, 0, i, j)) << 16 | to_byte(sample(img, 1, i, j)) << 8
+                    | to_byte(sample(img, 2, i, j));
+            }
+            cells[i * width + j] = glyph << 24 | rgb;
+        }
+    }
+}
+
+//One cell per 2x4 block of 1-bit pixels, coloured with the average colour of the block. The dithered
+//pixels are packed to bits first, so the two dots a cell takes from each row come out of one word.
+void terminal::braille_cells(const image& img){
+    dither_luma(img);
+    width = img.c() / 2;
+    height = img.r() / 4;
+    cells.resize(width * height);
+    dots.reshape(img.r(), img.c());
+    for(int i = 0; i < img.r(); i++){
+        const float* src = gray[i];
+        uint64_t* dst = dots[i];
+        for(int k = 0; k < dots.row_words(); k++){
+            uint64_t word = 0;
+            for(int j = k * 64; j < std::min(img.c(), k * 64 + 64); j++){
+                word |= uint64_t(src[j] > 0.5f) << (j & 63);
+            }
+            dst[k] = word;
+        }
+    }
+    for(int i = 0; i < height; i++){
+        for(int j = 0; j < width; j++){
+            //dots (0, 3), (1, 4), (2, 5) and (6, 7) of the pattern, from the four rows of the cell
+            uint32_t row[4];
+            for(int y = 0; y < 4; y++) row[y] = (dots[4*i + y][(2*j) >> 6] >> ((2*j) & 63)) & 3;
+            uint32_t glyph = (row[0] & 1) | (row[1] & 1) << 1 | (row[2] & 1) << 2
+                           | (row[0] >> 1) << 3 | (row[1] >> 1) << 4 | (row[2] >> 1) << 5 | row[3] << 6;
+            float sum[3] = {0, 0, 0};
+            for(int y = 0; color && y < 4; y++){
+                for(int x = 0; x < 2; x++){
+                    for(int k = 0; k < 3; k++) sum[k] += sample(img, k, 4*i + y, 2*j + x);
+                }
+            }
+            uint32_t rgb = color ? to_byte(sum[0] / 8) << 16 | to_byte(sum[1] / 8) << 8 | to_byte(sum[2] / 8) : 0;
+            cells[i * width + j] = glyph << 24 | rgb;
+        }
+    }
+}
+
+//Render one frame. Returns nonzero if the image was too small to draw.
+int terminal::draw(const image& original){
+    TRACE("terminal");
+    const image& img = fit(original);
+    const int w = width, h = height;
+    if(style == ASCII) ascii_cells(img);
+    else braille_cells(img);
+    if(!width || !height) return 1;
+    const int cw = style == ASCII ? 2 : 1;  //columns per cell
+
+    const bool full = !redraw || w != width || h != height || prev.size() != cells.size();
+    if(redraw && full) put("\033[?25l\033[H\033[2J", 13);
+    if(!redraw && style == ASCII) put("\n", 1);
+    uint32_t current = NO_COLOR;
+    int row = full ? 0 : -1, col = 0;   //cursor position when redrawing, -1 if unknown
+    for(int i = 0; i < height; i++){
+        for(int j = 0; j < width; j++){
+            const uint32_t cell = cells[i * width + j];
+            if(redraw){
+                if(!full && cell == prev[i * width + j]) continue;
+                if(row != i || col != j) move_to(i + 1, j * cw + 1);
+                row = i;
+                col = j + 1;
+            }
+            if(color && (cell & 0xffffff) != current){
+                current = cell & 0xffffff;
+                put_color(current);
+            }
+            const int glyph = cell >> 24;
+            if(style == ASCII){
+                const char pair[2] = {ramp[glyph], ramp[glyph]};
+                put(pair, 2);
+            }
+            else put(braille.utf8[glyph], 3);
+        }
+        if(!redraw){
+            if(color){
+                put("\033[0m", 4);
+                current = NO_COLOR;
+            }
+            put("\n", 1);
+        }
+        else if(full){
+            row = -1;
+        }
+    }
+    if(!redraw && style == BRAILLE) put("\n", 1);
+    if(redraw){
+        if(color) put("\033[0m", 4);
+        move_to(height + 1, 1);
+    }
+    std::swap(cells, prev);
+    emit();
+    return 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "image.hpp"
+#include "resample.hpp"
+
+//--------------------------------------[Terminal Renderer]-----------------------------------------
+
+//Draws images as text, either as an ASCII ramp (two characters per pixel) or as braille (2x4 pixels
+//per character). Each frame is assembled in one buffer and handed to the terminal with one write.
+//
+//With <redraw> set, frames are drawn in place from the top left corner and only the cells that
+//differ from the previous frame are rewritten, which is what makes video previews usable.
+class terminal{
+    public:
+        enum mode{ ASCII, BRAILLE };
+
+        terminal(int fd, mode m, bool color, bool redraw, resample_filter f = BOX);
+        ~terminal();
+        int draw(const image&);
+    private:
+        int fd;
+        mode style;
+        bool color, redraw;
+        resample_filter filter;
+        int cols, lines;                    //size of the terminal
+        int width, height;                  //size of the last frame, in cells
+        std::vector<uint32_t> cells, prev;  //glyph in the top 8 bits, colour in the low 24
+        std::vector<char> buf;
+        image small, gray;                  //the frame at terminal size, and its dithered luma
+        bit_plane dots;                     //braille dots, one bit per pixel
+
+        const image& fit(const image&);
+        void dither_luma(const image&);
+        void ascii_cells(const image&);
+        void braille_cells(const image&);
+        void emit();
+        void put(const char*, size_t);
+        void put_number(int);
+        void put_color(uint32_t);
+        void move_to(int row, int col);
+};
@@ -0,0 +1,67 @@
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "chain.hpp"
+#include "image.hpp"
+#include "imgutils.hpp"
+
+//Runs a colour image through the per-sample stages of --chain and checks that threshold and quantize
+//work on luma, as threshold() does, and leave a gray image. Exits nonzero on the first mismatch.
+
+//A colour image whose channels differ enough that thresholding them one by one would give colour.
+static image colour_ramp(){
+    image img(16, 64);
+    img.set_color(true);
+    img.set_format("P3");
+    img.set_maxval(255);
+    for(int i = 0; i < img.r(); i++){
+        for(int j = 0; j < img.c(); j++){
+            img.channel(0)[i][j] = j / 63.0f;
+            img.channel(1)[i][j] = 1 - j / 63.0f;
+            img.channel(2)[i][j] = (i % 4) / 3.0f;
+        }
+    }
+    img.update_luma();
+    return img;
+}
+
+static bool check(const char* spec, void (*expect)(image&)){
+    std::vector<chain_stage> chain;
+    if(!parse_chain(spec, chain) || chain.size() != 1 || chain[0].kind != CHAIN_POINTWISE){
+        printf("%s: not parsed as one pointwise stage\n", spec);
+        return false;
+    }
+    image got = colour_ramp();
+    image want = colour_ramp();
+    pointwise(got, chain[0].ops);
+    expect(want);
+    bool ok = !got.color() && got.get_format() == "P2";
+    for(int i = 0; i < got.r() && ok; i++){
+        for(int j = 0; j < got.c() && ok; j++) ok = fabsf(got[i][j] - want[i][j]) < 1e-6f;
+    }
+    printf("%s: %s\n", spec, ok ? "ok" : "changed");
+    return ok;
+}
+
+int main(){
+    int failed = 0;
+    failed += !check("threshold", [](image& img){ threshold(img, 0.5); });
+    failed += !check("threshold:0.3", [](image& img){ threshold(img, 0.3); });
+    failed += !check("remap:0.2:0.8,clip,threshold", [](image& img){
+        for(int p = 0; p < 3; p++){
+            for(int i = 0; i < img.r(); i++){
+                float* row = img.channel(p)[i];
+                for(int j = 0; j < img.c(); j++) row[j] = MIN(MAX(0.0f, (row[j] - 0.2f) / 0.6f), 1.0f);
+            }
+        }
+        img.update_luma();
+        threshold(img, 0.5);
+    });
+    failed += !check("quantize:2", [](image& img){
+        for(int i = 0; i < img.r(); i++){
+            for(int j = 0; j < img.c(); j++) img[i][j] = img[i][j] >= 0.5f ? 1.0f : 0.0f;
+        }
+    });
+    return failed ? 1 : 0;
+}
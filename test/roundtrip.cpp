@@ -0,0 +1,66 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "image.hpp"
+#include "ppm.hpp"
+
+//Decodes binary PGM and PPM images holding every sample value from 0 to maxval, writes them back out
+//and checks that the bytes are unchanged. Exits nonzero on the first mismatch.
+
+//A binary image of one row, whose channels each run through every value in [0, maxval]. The
+//channels of a P6 image are offset from one another so that they cannot be confused.
+static std::string every_value(const char* format, int maxval){
+    const int n = std::string(format) == "P6" ? 3 : 1;
+    const int w = maxval + 1;
+    const int bps = maxval > 255 ? 2 : 1;
+    std::string out = std::string(format) + "\n" + std::to_string(w) + " 1\n" + std::to_string(maxval) + "\n";
+    for(int j = 0; j < w; j++){
+        for(int k = 0; k < n; k++){
+            const int v = (j + k * w / 3) % w;
+            if(bps == 2) out += char(v >> 8);
+            out += char(v & 0xff);
+        }
+    }
+    return out;
+}
+
+//What writeppm() produces for <img>, read back through a temporary file.
+static std::string encode(const image& img){
+    char name[] = "/tmp/glitch-roundtrip-XXXXXX";
+    int fd = mkstemp(name);
+    if(fd < 0){
+        perror("mkstemp");
+        exit(2);
+    }
+    unlink(name);
+    if(writeppm(img, fd, true)){
+        fprintf(stderr, "writeppm failed\n");
+        exit(2);
+    }
+    std::string out;
+    char buf[1 << 16];
+    lseek(fd, 0, SEEK_SET);
+    for(ssize_t n; (n = read(fd, buf, sizeof(buf))) > 0;) out.append(buf, n);
+    close(fd);
+    return out;
+}
+
+int main(){
+    int failed = 0;
+    for(const char* format : {"P5", "P6"}){
+        for(int maxval : {255, 1023, 65535}){
+            const std::string src = every_value(format, maxval);
+            image img;
+            decodeppm(src.data(), src.size(), img);
+            const std::string out = encode(img);
+            const bool ok = out == src;
+            printf("%s maxval %d: %s\n", format, maxval, ok ? "ok" : "changed");
+            if(!ok) failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
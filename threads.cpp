@@ -0,0 +1,140 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "threads.hpp"
+
+//-------------------------------------------[Thread Pool]------------------------------------------
+
+//A fixed set of workers that all pull bands of rows from one shared counter. The calling thread
+//works on bands too, and parallel_rows() returns only once every band is finished. A pass that is
+//started while another one is running (from a worker, or from a second thread) runs serially on the
+//caller, so passes can be nested freely.
+class pool{
+    private:
+        std::vector<std::thread> workers;
+        std::mutex m;
+        std::condition_variable wake, finished;
+        std::mutex busy;
+        const callback<int, int>* job;
+        int rows, band, bands;
+        std::atomic<int> next;
+        int pending;
+        unsigned generation;
+        bool stop;
+
+        void run_bands(){
+            int b;
+            while((b = next.fetch_add(1)) < bands){
+                int r0 = b * band;
+                (*job)(r0, std::min(r0 + band, rows));
+            }
+        }
+
+        void worker(){
+            in_pool = true;
+            unsigned seen = 0;
+            for(;;){
+                {
+                    std::unique_lock<std::mutex> lock(m);
+                    wake.wait(lock, [&]{ return stop || generation != seen; });
+                    if(stop) return;
+                    seen = generation;
+                }
+                run_bands();
+                std::lock_guard<std::mutex> lock(m);
+                if(--pending == 0) finished.notify_one();
+            }
+        }
+    public:
+        static thread_local bool in_pool;
+
+        pool(int n): job(nullptr), rows(0), band(0), bands(0), next(0), pending(0), generation(0), stop(false) {
+            for(int i = 0; i < n - 1; i++) workers.emplace_back(&pool::worker, this);
+        }
+        ~pool(){
+            {
+                std::lock_guard<std::mutex> lock(m);
+                stop = true;
+            }
+            wake.notify_all();
+            for(std::thread& t : workers) t.join();
+        }
+        int size() const { return workers.size() + 1; }
+
+        //Bands are handed out in increasing order of their first row.
+        void run(int n, int span, const callback<int, int>& fn){
+            std::unique_lock<std::mutex> owner(busy, std::try_to_lock);
+            if(in_pool || !owner.owns_lock() || workers.empty() || n <= span){
+                fn(0, n);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m);
+                job = &fn;
+                rows = n;
+                band = span;
+                bands = (n + band - 1) / band;
+                next = 0;
+                pending = workers.size();
+                generation++;
+            }
+            wake.notify_all();
+            run_bands();
+            std::unique_lock<std::mutex> lock(m);
+            finished.wait(lock, [&]{ return pending == 0; });
+        }
+};
+
+thread_local bool pool::in_pool = false;
+
+static int requested = 0;
+static std::unique_ptr<pool> shared;
+static std::once_flag started;
+
+//Number of threads to use for every parallel pass. 0 (the default) means one per hardware thread.
+//Must be called before the first parallel pass.
+void set_threads(int n){
+    requested = n;
+}
+
+static pool& get_pool(){
+    std::call_once(started, []{
+        int n = requested > 0 ? requested : std::thread::hardware_concurrency();
+        shared.reset(new pool(std::max(n, 1)));
+    });
+    return *shared;
+}
+
+int thread_count(){
+    return get_pool().size();
+}
+
+//Run every pass started from the calling thread serially on that thread. For threads that already
+//have a whole job each, such as the workers of batch mode.
+void run_serially(bool on){
+    pool::in_pool = on;
+}
+
+//Split rows [0, rows) into bands of at least <grain> rows and call fn(first, last) on each band,
+//spread across the pool. Every row is visited exactly once, so any pass whose rows are independent
+//produces the same result as a serial loop.
+void parallel_rows(int rows, callback<int, int> fn, int grain){
+    pool& p = get_pool();
+    //a few bands per thread so that uneven rows still balance out
+    int band = std::max(grain, (rows + p.size() * 4 - 1) / (p.size() * 4));
+    p.run(rows, band, fn);
+}
+
+//Call fn(i) for every i in [0, n), in parallel. Indices are handed out one at a time and in order,
+//so fn(i) may wait on progress made by fn(i - 1).
+void parallel_for(int n, callback<int> fn){
+    auto each = [&](int first, int last){
+        for(int i = first; i < last; i++) fn(i);
+    };
+    get_pool().run(n, 1, each);
+}
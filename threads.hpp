@@ -0,0 +1,59 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+//Rows per band below which splitting the work further is not worth a hand-off.
+#define MIN_BAND 8
+
+//Non-owning reference to a callable, for handing a pass to the pool. Unlike std::function it never
+//allocates, however much the callable captures. The callable must outlive the call it is passed to.
+template<typename... Args>
+class callback{
+    private:
+        const void* obj;
+        void (*invoke)(const void*, Args...);
+    public:
+        template<typename F>
+        callback(const F& f): obj(&f),
+            invoke([](const void* o, Args... a){ (*static_cast<const F*>(o))(a...); }) {}
+        void operator()(Args... a) const { invoke(obj, a...); }
+};
+
+void set_threads(int);
+int thread_count();
+void run_serially(bool);
+void parallel_rows(int rows, callback<int, int> fn, int grain = MIN_BAND);
+void parallel_for(int n, callback<int> fn);
+
+//------------------------------------------[Bounded Queue]-----------------------------------------
+
+//First-in first-out hand-off between threads, stored in a fixed ring so that passing items along
+//never allocates. push() blocks while <n> items are waiting and pop() blocks while none are.
+template<typename T>
+class bounded_queue{
+    private:
+        std::mutex m;
+        std::condition_variable not_full, not_empty;
+        std::vector<T> ring;
+        size_t head, count;
+    public:
+        bounded_queue(size_t n): ring(n), head(0), count(0) {}
+
+        void push(T item){
+            std::unique_lock<std::mutex> lock(m);
+            not_full.wait(lock, [&]{ return count < ring.size(); });
+            ring[(head + count++) % ring.size()] = std::move(item);
+            not_empty.notify_one();
+        }
+        T pop(){
+            std::unique_lock<std::mutex> lock(m);
+            not_empty.wait(lock, [&]{ return count > 0; });
+            T item = std::move(ring[head]);
+            head = (head + 1) % ring.size();
+            count--;
+            not_full.notify_one();
+            return item;
+        }
+};
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "canny.hpp"
+#include "image.hpp"
+#include "pixelsort.hpp"
+#include "ppm.hpp"
+#include "threads.hpp"
+#include "tiles.hpp"
+#include "trace.hpp"
+
+//Out-of-core processing for images that do not fit in memory. The image is worked through in strips
+//of whole rows, each decoded from the memory-mapped file together with a halo of the rows around it
+//that the stages read, and the output is written strip by strip, top to bottom. Edge detection (-e)
+//and sorting along rows (-s) can run this way; the other effects carry state across the whole image.
+//
+//The edges come out identical to those of the in-memory path:
+//  - the halo covers the footprint of every stage, so each strip sees the same samples it would in
+//    the whole image,
+//  - the thresholds are statistics of the whole image, gathered by two sweeps that add up the
+//    per-row sums in row order, like threshold_values(),
+//  - hysteresis is global too: a third sweep labels the candidate runs of every strip and joins the
+//    components that reach a seam in one union-find over the image, which the last sweep, the one
+//    that writes the output, consults to tell which of them hold a strong pixel.
+//Strips are recomputed from the file by every sweep rather than kept, so memory stays bounded.
+
+//Rows each stage reads beyond the rows it writes
+#define HALO_GAUSSIAN 2
+#define HALO_SOBEL 1
+#define HALO_NMS 1
+
+//Heap that does not grow with the strip, such as the output buffer
+#define FIXED_BYTES (2 << 20)
+
+//Strips shorter than this would spend most of their time on the halo.
+#define MIN_STRIP 16
+
+//A byte count with an optional K, M or G suffix.
+bool parse_size(const std::string& s, size_t& bytes){
+    char* end;
+    double v = strtod(s.c_str(), &end);
+    if(end == s.c_str() || !(v > 0)) return false;
+    std::string unit(end);
+    double scale;
+    if(unit.empty()) scale = 1;
+    else if(unit == "K" || unit == "k") scale = 1 << 10;
+    else if(unit == "M" || unit == "m") scale = 1 << 20;
+    else if(unit == "G" || unit == "g") scale = 1 << 30;
+    else return false;
+    bytes = size_t(v * scale);
+    return true;
+}
+
+//Rough heap use per image row: the decoded planes, the smoothed image and magnitude, a byte each for
+//direction and class, an allowance for candidate runs, and the output.
+static size_t row_bytes(int cols, bool color, int flag){
+    const size_t planes = color ? 4 : 1;
+    const size_t out = flag == 's' ? 4 * planes : 1;
+    return size_t(cols) * (4 * planes + 4 + 4 + 1 + 1 + 8 + out);
+}
+
+//---------------------------------------------[Strips]---------------------------------------------
+
+//Buffers for one strip, reused from strip to strip.
+struct strip{
+    int first, last;        //image rows the strip produces
+    int top;                //image row held in row 0 of the buffers
+    image src;
+    canny_scratch canny;
+    edge_mask edges;
+    int offset() const { return first - top; }
+    int rows() const { return last - first; }
+};
+
+//Decode strip after strip of <rows> rows, each with <halo> rows on either side where the image has
+//them, and hand them to <fn>. Rows that no later strip reads are released as the sweep goes.
+template<typename F>
+static void sweep(mapped_pnm& in, strip& s, int rows, int halo, F fn){
+    const int h = in.header().height;
+    for(int first = 0; first < h; first += rows){
+        s.first = first;
+        s.last = std::min(h, first + rows);
+        s.top = std::max(0, first - halo);
+        in.read(s.top, std::min(h, s.last + halo) - s.top, s.src);
+        fn(s);
+        in.release(std::max(0, s.last - halo));
+    }
+    in.release(h);
+}
+
+//Smooth the strip and take its gradient. Rows [first, last) come out as for the whole image as long
+//as the strip has HALO_GAUSSIAN + HALO_SOBEL rows of halo.
+static void magnitude(strip& s){
+    canny_scratch& c = s.canny;
+    gaussian(s.src, c.smooth);
+    c.mag.reshape(s.src.r(), s.src.c(), false);
+    c.dir.reshape(s.src.r(), s.src.c());
+    gradient(c.smooth.y(), c.mag.y(), c.dir);
+}
+
+//threshold_values() for the whole image: the first sweep finds the average magnitude and the second
+//splits the magnitudes at it.
+static void thresholds(mapped_pnm& in, strip& s, int rows, double& weak, double& strong){
+    TRACE("threshold_values");
+    const int halo = HALO_GAUSSIAN + HALO_SOBEL;
+    std::vector<double> sums(2 * rows);
+    std::vector<int> counts(2 * rows);
+    double* sum = sums.data();
+    double* ssum = sum + rows;
+    int* num = counts.data();
+    int* snum = num + rows;
+    double average = 0;
+    int64_t count = 0;
+    sweep(in, s, rows, halo, [&](strip& s){
+        magnitude(s);
+        parallel_rows(s.rows(), [&](int first, int last){
+            for(int i = first; i < last; i++){
+                magnitude_sums(s.canny.mag[s.offset() + i], s.src.c(), sum[i], num[i]);
+            }
+        });
+        for(int i = 0; i < s.rows(); i++){
+            average += sum[i];
+            count += num[i];
+        }
+    });
+    average /= count;
+    double weak_avg = 0;
+    int64_t weak_count = 0;
+    double strong_avg = 0;
+    int64_t strong_count = 0;
+    sweep(in, s, rows, halo, [&](strip& s){
+        magnitude(s);
+        parallel_rows(s.rows(), [&](int first, int last){
+            for(int i = first; i < last; i++){
+                magnitude_sums(s.canny.mag[s.offset() + i], s.src.c(), average, sum[i], num[i], ssum[i], snum[i]);
+            }
+        });
+        for(int i = 0; i < s.rows(); i++){
+            weak_avg += sum[i];
+            weak_count += num[i];
+            strong_avg += ssum[i];
+            strong_count += snum[i];
+        }
+    });
+    weak = weak_avg/weak_count;
+    strong = strong_avg/strong_count;
+}
+
+//EDGE_* classes of the strip. Needs the full halo.
+static void classify(strip& s, double weak, double strong){
+    magnitude(s);
+    nmsuppression(s.canny.dir, s.canny.mag, weak, strong, s.canny.classes);
+}
+
+//-------------------------------------------[Hysteresis]-------------------------------------------
+
+//Components of candidate runs that reach the top or bottom row of their strip, where the next strip
+//may continue them. They are numbered in the order the sweep meets them and joined across seams with
+//one union-find over the whole image.
+struct seam_components{
+    std::vector<int> parent;
+    std::vector<char> strong;
+
+    int find(int x){
+        while(parent[x] != x){
+            parent[x] = parent[parent[x]];
+            x = parent[x];
+        }
+        return x;
+    }
+    void join(int a, int b){
+        a = find(a);
+        b = find(b);
+        if(a == b) return;
+        if(b < a) std::swap(a, b);
+        parent[b] = a;
+        strong[a] |= strong[b];
+    }
+};
+
+//A run on the bottom row of the previous strip, and the seam component it belongs to.
+struct seam_run{
+    int start, end, id;
+};
+
+//Label the candidate runs of the strip and number the components that reach its top or bottom row,
+//counting on from <next>. <ids> maps the root of every such component to its number and every other
+//run to -1. Both hysteresis sweeps number the same components in the same order.
+static void label(strip& s, int height, int& next, std::vector<int>& ids){
+    canny_scratch& c = s.canny;
+    const int n = s.rows();
+    label_runs(c.classes, s.offset(), s.offset() + n, c);
+    ids.assign(c.runs.size(), -1);
+    auto number = [&](int row){
+        for(int k = c.begin[row]; k < c.begin[row + 1]; k++){
+            if(ids[c.parent[k]] < 0) ids[c.parent[k]] = next++;
+        }
+    };
+    if(s.first > 0) number(0);
+    if(s.last < height) number(n - 1);
+}
+
+//Join the components of the strip's top row with those of the previous strip's bottom row that they
+//touch, including diagonally, then keep the strip's bottom row for the next seam.
+static void stitch(const strip& s, const std::vector<int>& ids, seam_components& seams, std::vector<seam_run>& prev){
+    const canny_scratch& c = s.canny;
+    if(s.first > 0){
+        size_t a = 0;
+        for(int b = c.begin[0]; b < c.begin[1]; b++){
+            while(a < prev.size() && prev[a].end < c.runs[b].start) a++;
+            for(size_t k = a; k < prev.size() && prev[k].start <= c.runs[b].end; k++){
+                seams.join(prev[k].id, ids[c.parent[b]]);
+            }
+        }
+    }
+    prev.clear();
+    const int n = s.rows();
+    for(int k = c.begin[n - 1]; k < c.begin[n]; k++){
+        prev.push_back(seam_run{c.runs[k].start, c.runs[k].end, ids[c.parent[k]]});
+    }
+}
+
+//-------------------------------------------[Tiled Mode]-------------------------------------------
+
+//Images that fit in the budget, and plain images, are read whole as usual.
+static int whole(const std::string& infile, const std::string& outfile, const settings& s){
+    image img = openppm(infile);
+    const bool raw = binary_output(s, img);
+    workspace space;
+    const result res = apply(s, img, space);
+    return outfile.empty() ? res.write(STDOUT_FILENO, raw) : res.save(outfile, raw);
+}
+
+//Apply the effect in <s> to <infile> within roughly <budget> bytes of heap, strip by strip, and
+//write the result to <outfile> or stdout.
+int tiled(const std::string& infile, const std::string& outfile, const settings& s, size_t budget){
+    TRACE("tiled");
+    mapped_pnm in;
+    const bool mapped = in.open(infile);
+    const pnm_header& h = in.header();
+    const size_t per_row = row_bytes(h.width, h.channels() == 3, s.flag);
+    if(h.format.empty() || per_row * h.height <= budget) return whole(infile, outfile, s);
+    if(!mapped){
+        std::cerr << "Images larger than --max-memory must be binary PBM, PGM or PPM files.\n";
+        return 1;
+    }
+    if(s.flag != 'e' && !(s.flag == 's' && s.sort.angle == 0)){
+        std::cerr << "Only -e and -s along rows can work on images larger than --max-memory.\n";
+        return 1;
+    }
+    const int halo = HALO_GAUSSIAN + HALO_SOBEL + HALO_NMS;
+    const int rows = budget > FIXED_BYTES ? int(std::min<size_t>((budget - FIXED_BYTES) / per_row, h.height)) - 2 * halo : 0;
+    if(rows < MIN_STRIP){
+        std::cerr << "--max-memory is too small for an image this wide.\n";
+        return 1;
+    }
+
+    strip st;
+    double weak, strong;
+    thresholds(in, st, rows, weak, strong);
+
+    //join the components that cross seams and find out which of them hold a strong pixel
+    seam_components seams;
+    std::vector<int> ids;
+    std::vector<seam_run> prev;
+    int next = 0;
+    sweep(in, st, rows, halo, [&](strip& st){
+        TRACE("hysteresis");
+        classify(st, weak, strong);
+        label(st, h.height, next, ids);
+        const canny_scratch& c = st.canny;
+        seams.parent.resize(next);
+        seams.strong.resize(next);
+        for(size_t k = 0; k < c.runs.size(); k++){
+            if(ids[k] >= 0){
+                seams.parent[ids[k]] = ids[k];
+                seams.strong[ids[k]] = c.keep[k];
+            }
+        }
+        stitch(st, ids, seams, prev);
+    });
+
+    int fd = outfile.empty() ? STDOUT_FILENO : open(outfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        std::cerr << "Unable to open output file.\n";
+        return 1;
+    }
+    const bool edges = s.flag == 'e';
+    band_writer out(fd, edges ? "P2" : h.format, h.height, h.width, edges ? 255 : st.src.get_maxval(), true);
+    image8 lines;
+    image band;
+    next = 0;
+    sweep(in, st, rows, halo, [&](strip& st){
+        classify(st, weak, strong);
+        label(st, h.height, next, ids);
+        canny_scratch& c = st.canny;
+        for(size_t k = 0; k < c.runs.size(); k++){
+            if(ids[k] >= 0) c.keep[k] = seams.strong[seams.find(ids[k])];
+        }
+        kept_runs(c, h.width, st.edges);
+        const int n = st.rows();
+        if(edges){
+            lines.reshape(n, h.width, false);
+            lines.set_maxval(255);
+            draw_edges(st.edges, lines);
+            out.write(lines);
+            return;
+        }
+        band.reshape(n, h.width, st.src.color());
+        band.set_format(st.src.get_format());
+        band.set_maxval(st.src.get_maxval());
+        for(int i = 0; i < n; i++){
+            memcpy(band[i], st.src[st.offset() + i], h.width * sizeof(float));
+            for(int k = 0; k < 3 && band.color(); k++){
+                memcpy(band.channel(k)[i], st.src.channel(k)[st.offset() + i], h.width * sizeof(float));
+            }
+        }
+        pixelsort(band, st.edges, s.sort);
+        out.write(band);
+    });
+    int ret = out.ok() ? 0 : 1;
+    if(fd != STDOUT_FILENO && close(fd) != 0) ret = 1;
+    return ret;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "modes.hpp"
+
+//--------------------------------------------[Tiled Mode]------------------------------------------
+
+bool parse_size(const std::string&, size_t& bytes);
+int tiled(const std::string& infile, const std::string& outfile, const settings&, size_t budget);
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <malloc.h>
+
+#include "trace.hpp"
+
+bool trace_enabled = false;
+
+//-------------------------------------------[Heap Counters]----------------------------------------
+
+//Block sizes are taken from malloc_usable_size() on the way in and on the way out, so they always
+//match, whichever path freed the block. Blocks allocated before tracing started were never counted,
+//so freeing them may not take the live size below zero, where it would pull every later peak down.
+static std::atomic<int64_t> alloc_count(0), alloc_bytes(0), live_bytes(0), peak_bytes(0), max_live(0);
+
+static void raise_to(std::atomic<int64_t>& a, int64_t v){
+    int64_t cur = a.load(std::memory_order_relaxed);
+    while(cur < v && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed));
+}
+
+void count_alloc(void* p){
+    const int64_t n = malloc_usable_size(p);
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+    const int64_t live = live_bytes.fetch_add(n, std::memory_order_relaxed) + n;
+    raise_to(peak_bytes, live);
+    raise_to(max_live, live);
+}
+
+void count_free(void* p){
+    const int64_t n = malloc_usable_size(p);
+    int64_t cur = live_bytes.load(std::memory_order_relaxed);
+    while(!live_bytes.compare_exchange_weak(cur, std::max<int64_t>(0, cur - n), std::memory_order_relaxed));
+}
+
+void* operator new(size_t n){
+    void* p = malloc(n ? n : 1);
+    if(!p) throw std::bad_alloc();
+    trace_alloc(p);
+    return p;
+}
+
+void* operator new[](size_t n){
+    return operator new(n);
+}
+
+void operator delete(void* p) noexcept {
+    trace_free(p);
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+//--------------------------------------------[Scopes]----------------------------------------------
+
+typedef std::chrono::steady_clock clock_type;
+
+struct event{
+    const char* name;
+    int tid;
+    int64_t start, dur;                 //nanoseconds since tracing started
+    int64_t allocs, bytes, peak;
+};
+
+static clock_type::time_point epoch;
+static std::mutex events_lock;
+static std::vector<event> events;
+static std::string trace_path;
+static bool print_table = false;
+static std::atomic<int> next_tid(0);
+
+static int thread_id(){
+    static thread_local int id = next_tid.fetch_add(1);
+    return id;
+}
+
+static int64_t now_ns(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - epoch).count();
+}
+
+//The peak counter is reset to the live size when a scope opens and, when it closes, raised back to
+//at least what the enclosing scope had seen, so every scope gets its own high-water mark.
+void trace_scope::open(){
+    allocs = alloc_count.load(std::memory_order_relaxed);
+    bytes = alloc_bytes.load(std::memory_order_relaxed);
+    live = live_bytes.load(std::memory_order_relaxed);
+    outer_peak = peak_bytes.exchange(live, std::memory_order_relaxed);
+    start = now_ns();
+}
+
+void trace_scope::close(){
+    const int64_t end = now_ns();
+    event e = {name, thread_id(), start, end - start,
+               alloc_count.load(std::memory_order_relaxed) - allocs,
+               alloc_bytes.load(std::memory_order_relaxed) - bytes,
+               std::max<int64_t>(0, peak_bytes.load(std::memory_order_relaxed) - live)};
+    raise_to(peak_bytes, outer_peak);
+    std::lock_guard<std::mutex> lock(events_lock);
+    events.push_back(e);
+}
+
+//--------------------------------------------[Output]----------------------------------------------
+
+static void write_trace(){
+    FILE* f = fopen(trace_path.c_str(), "w");
+    if(!f){
+        std::cerr << "Unable to open trace file.\n";
+        return;
+    }
+    fprintf(f, "{\"traceEvents\": [\n");
+    for(size_t k = 0; k < events.size(); k++){
+        const event& e = events[k];
+        fprintf(f, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                   "\"args\": {\"allocs\": %lld, \"alloc_bytes\": %lld, \"peak_bytes\": %lld}}%s\n",
+                e.name, e.tid, e.start / 1e3, e.dur / 1e3, (long long)e.allocs, (long long)e.bytes,
+                (long long)e.peak, k + 1 < events.size() ? "," : "");
+    }
+    fprintf(f, "], \"displayTimeUnit\": \"ms\"}\n");
+    if(fclose(f) != 0) std::cerr << "Unable to write trace file.\n";
+}
+
+//One line per stage, in the order the stages first ran. Nested stages are also counted in the
+//stages that contain them.
+static void print_stats(){
+    struct total{
+        const char* name;
+        int calls;
+        int64_t time, longest, allocs, bytes, peak;
+    };
+    std::vector<total> totals;
+    for(const event& e : events){
+        auto t = std::find_if(totals.begin(), totals.end(), [&](const total& t){ return t.name == e.name; });
+        if(t == totals.end()){
+            totals.push_back(total{e.name, 0, 0, 0, 0, 0, 0});
+            t = totals.end() - 1;
+        }
+        t->calls++;
+        t->time += e.dur;
+        t->longest = std::max(t->longest, e.dur);
+        t->allocs += e.allocs;
+        t->bytes += e.bytes;
+        t->peak = std::max(t->peak, e.peak);
+    }
+    fprintf(stderr, "%-18s %7s %11s %10s %10s %10s %11s %10s\n",
+            "stage", "calls", "total ms", "mean ms", "max ms", "allocs", "alloc MB", "peak MB");
+    for(const total& t : totals){
+        fprintf(stderr, "%-18s %7d %11.3f %10.3f %10.3f %10lld %11.2f %10.2f\n",
+                t.name, t.calls, t.time / 1e6, t.time / 1e6 / t.calls, t.longest / 1e6,
+                (long long)t.allocs, t.bytes / 1048576.0, t.peak / 1048576.0);
+    }
+    fprintf(stderr, "%.3f ms in total, %lld allocations, %.2f MB allocated, %.2f MB peak live heap\n",
+            now_ns() / 1e6, (long long)alloc_count.load(), alloc_bytes.load() / 1048576.0,
+            max_live.load() / 1048576.0);
+}
+
+static void finish_tracing(){
+    std::lock_guard<std::mutex> lock(events_lock);
+    trace_enabled = false;
+    std::sort(events.begin(), events.end(), [](const event& a, const event& b){ return a.start < b.start; });
+    if(!trace_path.empty()) write_trace();
+    if(print_table) print_stats();
+}
+
+void start_tracing(const std::string& trace_file, bool stats){
+    trace_path = trace_file;
+    print_table = stats;
+    events.reserve(4096);
+    epoch = clock_type::now();
+    atexit(finish_tracing);
+    trace_enabled = true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+//--------------------------------------------[Tracing]---------------------------------------------
+
+//Scoped timers around the stages of the pipeline. While tracing is off a scope costs one load and a
+//branch. While it is on, every scope records its wall time, the number and size of the heap
+//allocations made while it was open, and the peak of live heap bytes above what was live when it
+//opened. The heap is counted for the whole process, so scopes that are open at the same time on
+//different threads (batch and frame modes) see each other's allocations. Only blocks allocated after
+//tracing starts count towards the live heap and its peaks.
+
+extern bool trace_enabled;
+
+//Turn tracing on. When the program exits, the recorded scopes are written to <trace_file> in Chrome's
+//trace event format (chrome://tracing, ui.perfetto.dev) unless it is empty, and a summary table per
+//stage goes to stderr if <stats> is set.
+void start_tracing(const std::string& trace_file, bool stats);
+
+void count_alloc(void*);
+void count_free(void*);
+
+//Called for every block handed out or returned by operator new/delete and by the image planes.
+inline void trace_alloc(void* p){
+    if(trace_enabled && p) count_alloc(p);
+}
+
+inline void trace_free(void* p){
+    if(trace_enabled && p) count_free(p);
+}
+
+class trace_scope{
+    private:
+        const char* name;
+        int64_t start, allocs, bytes, live, outer_peak;
+        void open();
+        void close();
+    public:
+        trace_scope(const char* n): name(nullptr) {
+            if(trace_enabled){
+                name = n;
+                open();
+            }
+        }
+        ~trace_scope(){ if(name) close(); }
+        trace_scope(const trace_scope&) = delete;
+        trace_scope& operator=(const trace_scope&) = delete;
+};
+
+#define TRACE_JOIN(a, b) a##b
+#define TRACE_LABEL(a, b) TRACE_JOIN(a, b)
+
+//Time the rest of the enclosing block as the stage <name>, which must be a string literal.
+#define TRACE(name) trace_scope TRACE_LABEL(trace_scope_, __LINE__)(name)